@@ -0,0 +1,193 @@
+#include <stdlib.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+#define LINE_WORDS 4
+
+static const struct {
+    const char *word;
+    enum target_type type;
+} targets[] = {
+    { "sink", TARGET_SINK },
+    { "source", TARGET_SOURCE },
+    { "app", TARGET_SINK_INPUT },
+};
+
+/* "[sink|source|app [GLOB]] COMMAND [ARG]". A target word without a glob
+ * means the default sink or source. A glob that is also a command name is
+ * read as the command, so a device called "mute" needs "mut[e]". */
+static int parse_line(char *line, struct selector *selector, struct command *command)
+{
+    char *words[LINE_WORDS + 1];
+    int targeted = 0;
+    size_t n = 0;
+    size_t i = 0;
+    char *save;
+
+    for (char *w = strtok_r(line, " \t", &save); w && n <= LINE_WORDS; w = strtok_r(NULL, " \t", &save))
+        words[n++] = w;
+    if (n == 0 || n > LINE_WORDS)
+        return -1;
+
+    for (size_t t = 0; t < sizeof(targets) / sizeof(targets[0]); t++) {
+        if (strcmp(words[0], targets[t].word) == 0) {
+            targeted = 1;
+            *selector = (struct selector){ targets[t].type, NULL };
+            i = 1;
+        }
+    }
+    if (targeted && i < n && lookup_command(words[i]) == CMD_NOP)
+        selector->pattern = words[i++];
+    if (targeted && selector->type == TARGET_SINK_INPUT && !selector->pattern)
+        return -1;
+
+    if (i >= n || n - i > 2)
+        return -1;
+    return parse_command(words[i], i + 1 < n ? words[i + 1] : NULL, command);
+}
+
+static int same_target(const struct selector *a, const struct selector *b)
+{
+    if (a->type != b->type || !a->pattern != !b->pattern)
+        return 0;
+    return !a->pattern || strcmp(a->pattern, b->pattern) == 0;
+}
+
+static struct batch_run *find_run(struct batch *batch, size_t *alloc, const struct selector *selector)
+{
+    struct batch_run *run;
+
+    for (size_t i = 0; i < batch->nruns; i++) {
+        if (same_target(&batch->runs[i].selector, selector))
+            return &batch->runs[i];
+    }
+
+    if (batch->nruns == *alloc) {
+        struct batch_run *grown;
+        *alloc = *alloc ? *alloc * 2 : 4;
+        grown = realloc(batch->runs, *alloc * sizeof(struct batch_run));
+        check_mem(grown);
+        batch->runs = grown;
+    }
+    run = &batch->runs[batch->nruns++];
+    *run = (struct batch_run){ .selector = *selector };
+    if (selector->pattern) {
+        run->pattern = strdup(selector->pattern);
+        check_mem(run->pattern);
+        run->selector.pattern = run->pattern;
+    }
+    return run;
+
+error:
+    return NULL;
+}
+
+static int add_command(struct batch_run *run, const struct command *command)
+{
+    if (run->count == run->alloc) {
+        struct command *grown;
+        size_t alloc = run->alloc ? run->alloc * 2 : 16;
+        grown = realloc(run->commands, alloc * sizeof(struct command));
+        check_mem(grown);
+        run->commands = grown;
+        run->alloc = alloc;
+    }
+    run->commands[run->count++] = *command;
+    return 0;
+
+error:
+    return -1;
+}
+
+int read_batch(const char *path, const struct selector *selector, struct batch *batch)
+{
+    FILE *file = NULL;
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t alloc = 0;
+    int lineno = 0;
+
+    *batch = (struct batch){ 0 };
+
+    if (strcmp(path, "-") == 0)
+        file = stdin;
+    else
+        file = fopen(path, "r");
+    check(file, "Can't open %s", path);
+
+    while (getline(&line, &line_size, file) >= 0) {
+        char *text = line + strspn(line, " \t");
+        struct selector target = *selector;
+        struct batch_run *run = NULL;
+        struct command command;
+        char *copy;
+        int rc;
+
+        lineno++;
+        text[strcspn(text, "\r\n#")] = '\0';
+        if (text[strspn(text, " \t")] == '\0')
+            continue;
+
+        copy = strdup(text);
+        check_mem(copy);
+        rc = parse_line(copy, &target, &command);
+        if (rc == 0)
+            run = find_run(batch, &alloc, &target);
+        free(copy);
+        check(rc == 0, "%s:%d: invalid command %s", path, lineno, text);
+        check(run && add_command(run, &command) == 0, "Out of memory reading %s", path);
+    }
+    check(!ferror(file), "Error reading %s", path);
+
+    free(line);
+    if (file != stdin)
+        fclose(file);
+    return 0;
+
+error:
+    free(line);
+    free_batch(batch);
+    if (file && file != stdin)
+        fclose(file);
+    return -1;
+}
+
+void free_batch(struct batch *batch)
+{
+    for (size_t i = 0; i < batch->nruns; i++) {
+        free(batch->runs[i].pattern);
+        free(batch->runs[i].commands);
+    }
+    free(batch->runs);
+    *batch = (struct batch){ 0 };
+}
+
+static void batch_done_cb(struct pmixer_priv *priv, int rc, const struct target *targets, size_t ntargets, void *raw)
+{
+    int *retval = raw;
+
+    if (*retval == 0)
+        *retval = rc;
+}
+
+/* Every target's run goes out at once and the answers are collected
+ * together, so runs for targets that overlap (the default sink and
+ * "sink *") are not ordered against each other. */
+int run_batch(struct pmixer_priv *priv, const struct batch *batch)
+{
+    int rc = 0;
+
+    for (size_t i = 0; i < batch->nruns; i++) {
+        const struct batch_run *run = &batch->runs[i];
+
+        if (submit_commands(priv, &run->selector, run->commands, run->count, batch_done_cb, &rc) != 0 &&
+            rc == 0)
+            rc = -1;
+    }
+    check(wait_ops(priv) == 0, "Lost connection to server.");
+    return rc;
+
+error:
+    return -1;
+}
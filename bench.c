@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+#define HISTOGRAM_BUCKETS 24
+
+struct bench {
+    const char *name;
+    uint64_t *samples;
+    size_t n;
+    uint64_t wall;
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(struct bench *b)
+{
+    size_t buckets[HISTOGRAM_BUCKETS] = { 0 };
+    size_t widest = 0;
+
+    if (b->n == 0) {
+        printf("%s: no samples\n\n", b->name);
+        return;
+    }
+
+    qsort(b->samples, b->n, sizeof(uint64_t), cmp_u64);
+    printf("%s: %zu runs, %.1f ops/s\n", b->name, b->n, b->n * 1e6 / (b->wall ? b->wall : 1));
+    printf("  min %.3fms  median %.3fms  p99 %.3fms  max %.3fms\n",
+           b->samples[0] / 1000.0, b->samples[b->n / 2] / 1000.0,
+           b->samples[(b->n * 99) / 100] / 1000.0, b->samples[b->n - 1] / 1000.0);
+
+    for (size_t i = 0; i < b->n; i++) {
+        int bucket = 0;
+        for (uint64_t v = b->samples[i]; v > 1 && bucket < HISTOGRAM_BUCKETS - 1; v >>= 1)
+            bucket++;
+        buckets[bucket]++;
+        if (buckets[bucket] > widest)
+            widest = buckets[bucket];
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (!buckets[i])
+            continue;
+        printf("  < %8.3fms %6zu ", (2ULL << i) / 1000.0, buckets[i]);
+        for (size_t j = 0; j < (buckets[i] * 40 + widest - 1) / widest; j++)
+            putchar('#');
+        putchar('\n');
+    }
+    putchar('\n');
+}
+
+static int bench_cold(struct bench *b)
+{
+    struct selector selector = { TARGET_SINK, NULL };
+    uint64_t start = now_usec();
+
+    for (size_t i = 0; i < b->n; i++) {
+        struct pmixer_priv priv = { .op_timeout_ms = 2000 };
+        uint64_t t = now_usec();
+
+        check(setup_context(&priv) == 0, "Can't set up context.");
+        check(connect_server(&priv, NULL, 1, 2000) == 0, "Can't connect.");
+        check(run_commands(&priv, &selector, NULL, 0) == 0, "Can't query default sink.");
+        teardown_context(&priv);
+        b->samples[i] = now_usec() - t;
+        continue;
+
+error:
+        teardown_context(&priv);
+        return -1;
+    }
+    b->wall = now_usec() - start;
+    return 0;
+}
+
+static int bench_commands(struct pmixer_priv *priv, struct bench *b, const struct selector *selector)
+{
+    uint64_t start = now_usec();
+
+    for (size_t i = 0; i < b->n; i++) {
+        uint64_t t = now_usec();
+
+        struct command command = { i % 2 ? CMD_DEC : CMD_INC };
+        check(run_command(priv, selector, &command) == 0, "Command failed.");
+        b->samples[i] = now_usec() - t;
+    }
+    b->wall = now_usec() - start;
+    return 0;
+
+error:
+    return -1;
+}
+
+static long rss_kib(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size, rss = -1;
+
+    if (!f)
+        return -1;
+    if (fscanf(f, "%ld %ld", &size, &rss) != 2)
+        rss = -1;
+    fclose(f);
+    return rss < 0 ? -1 : rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Runs commands through the sink cache like the daemon and the library do,
+ * and reports resident memory once the pools have warmed up. PipeWire has
+ * no cache, so there it is the same commands on one connection. */
+static int bench_memory(size_t count)
+{
+    struct selector selector = { TARGET_SINK, NULL };
+    struct pmixer_priv priv = { .op_timeout_ms = 2000 };
+    size_t warmup = count / 100 ? count / 100 : 1;
+    size_t step = count / 10 ? count / 10 : 1;
+    long start = -1;
+    int retval;
+
+    check(setup_context(&priv) == 0, "Can't set up context.");
+    check(connect_server(&priv, NULL, 1, 2000) == 0, "Can't connect.");
+#ifndef PMIXER_PIPEWIRE
+    priv.cache = cache_new(&priv);
+    check(priv.cache && wait_ops(&priv) == 0, "Can't populate sink cache.");
+#endif
+
+    printf("steady-state memory: %zu commands\n", count);
+    for (size_t i = 0; i < count; i++) {
+        struct command command = { i % 2 ? CMD_DEC : CMD_INC };
+
+        check(run_command(&priv, &selector, &command) == 0, "Command failed.");
+        if (i + 1 == warmup)
+            start = rss_kib();
+        if ((i + 1) % step == 0)
+            printf("  %10zu  rss %ld KiB\n", i + 1, rss_kib());
+    }
+    printf("  growth after warmup: %ld KiB\n\n", rss_kib() - start);
+    retval = 0;
+    goto out;
+
+error:
+    retval = -1;
+out:
+#ifndef PMIXER_PIPEWIRE
+    if (priv.cache)
+        cache_free(priv.cache);
+    priv.cache = NULL;
+#endif
+    teardown_context(&priv);
+    return retval;
+}
+
+static int daemon_request(const char *path, const char *request)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char reply[64];
+    ssize_t n;
+    int fd = -1;
+
+    check(strlen(path) < sizeof(addr.sun_path), "Socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    check(fd >= 0, "Can't create socket.");
+    check(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0, "Can't connect to daemon at %s", path);
+    check(send(fd, request, strlen(request), MSG_NOSIGNAL) == (ssize_t)strlen(request), "Can't send request.");
+    n = read(fd, reply, sizeof(reply) - 1);
+    check(n >= 2 && strncmp(reply, "ok", 2) == 0, "Daemon request failed.");
+    close(fd);
+    return 0;
+
+error:
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+static int bench_daemon(struct bench *b, const char *path)
+{
+    uint64_t start = now_usec();
+
+    for (size_t i = 0; i < b->n; i++) {
+        uint64_t t = now_usec();
+
+        check(daemon_request(path, i % 2 ? "dec\n" : "inc\n") == 0, "Daemon round trip failed.");
+        b->samples[i] = now_usec() - t;
+    }
+    b->wall = now_usec() - start;
+    return 0;
+
+error:
+    return -1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: pmixer-bench [-n RUNS] [-s SOCKET] [-m COMMANDS]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    struct selector default_sink = { TARGET_SINK, NULL };
+    struct selector all_sinks = { TARGET_SINK, "*" };
+    struct pmixer_priv priv = { .op_timeout_ms = 2000 };
+    const char *socket_path = default_socket_path();
+    struct bench benches[] = {
+        { "cold connect + query" },
+        { "sequential inc/dec" },
+        { "pipelined inc/dec on all sinks" },
+        { "daemon round trip" },
+    };
+    size_t runs = 100;
+    size_t memory_runs = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:m:")) != -1) {
+        switch (opt) {
+            case 'n':
+                runs = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'm':
+                memory_runs = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (runs == 0)
+        usage();
+
+    for (int i = 0; i < 4; i++) {
+        benches[i].n = runs;
+        benches[i].samples = calloc(runs, sizeof(uint64_t));
+        check_mem(benches[i].samples);
+    }
+
+    check(bench_cold(&benches[0]) == 0, "Cold connect benchmark failed.");
+    report(&benches[0]);
+
+    check(setup_context(&priv) == 0, "Can't set up context.");
+    check(connect_server(&priv, NULL, 1, 2000) == 0, "Can't connect.");
+    check(bench_commands(&priv, &benches[1], &default_sink) == 0, "Sequential benchmark failed.");
+    report(&benches[1]);
+    check(bench_commands(&priv, &benches[2], &all_sinks) == 0, "Pipelined benchmark failed.");
+    report(&benches[2]);
+    teardown_context(&priv);
+
+    if (bench_daemon(&benches[3], socket_path) == 0)
+        report(&benches[3]);
+    else
+        printf("%s: skipped, no daemon on %s\n", benches[3].name, socket_path);
+
+    if (memory_runs)
+        check(bench_memory(memory_runs) == 0, "Memory benchmark failed.");
+
+    for (int i = 0; i < 4; i++)
+        free(benches[i].samples);
+    return 0;
+
+error:
+    teardown_context(&priv);
+    for (int i = 0; i < 4; i++)
+        free(benches[i].samples);
+    return 1;
+}
@@ -0,0 +1,263 @@
+#include <stdlib.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+struct cache_entry {
+    struct device_info info;
+    unsigned holds;
+    int stale;
+    struct cache_entry *next;
+};
+
+struct sink_cache {
+    struct pmixer_priv *priv;
+    struct cache_entry *entries;
+    char default_sink[SINK_NAME_MAX];
+    char default_source[SINK_NAME_MAX];
+    int server_pending;
+    cache_notify_cb_t notify;
+    void *notify_raw;
+};
+
+void cache_set_notify(struct sink_cache *cache, cache_notify_cb_t cb, void *raw)
+{
+    cache->notify = cb;
+    cache->notify_raw = raw;
+}
+
+static void notify(struct sink_cache *cache)
+{
+    if (cache->notify)
+        cache->notify(cache, cache->notify_raw);
+}
+
+/* Sink and source indices overlap, so entries are keyed by both. */
+static struct cache_entry **find_entry(struct sink_cache *cache, enum target_type type, uint32_t index)
+{
+    struct cache_entry **p;
+
+    for (p = &cache->entries; *p && ((*p)->info.type != type || (*p)->info.index != index); p = &(*p)->next)
+        ;
+    return p;
+}
+
+static struct cache_entry *set_entry(struct sink_cache *cache, const struct device_info *info)
+{
+    struct cache_entry **p = find_entry(cache, info->type, info->index);
+
+    if (!*p) {
+        *p = calloc(1, sizeof(struct cache_entry));
+        check_mem(*p);
+    }
+    (*p)->info = *info;
+    return *p;
+
+error:
+    return NULL;
+}
+
+void cache_update(struct sink_cache *cache, const struct device_info *info)
+{
+    set_entry(cache, info);
+}
+
+static void cache_remove(struct sink_cache *cache, enum target_type type, uint32_t index)
+{
+    struct cache_entry **p = find_entry(cache, type, index);
+    struct cache_entry *entry = *p;
+
+    if (entry) {
+        *p = entry->next;
+        free(entry);
+    }
+}
+
+struct device_info *cache_default(struct sink_cache *cache, enum target_type type)
+{
+    const char *name = type == TARGET_SOURCE ? cache->default_source : cache->default_sink;
+
+    if (cache->server_pending || name[0] == '\0')
+        return NULL;
+
+    for (struct cache_entry *e = cache->entries; e; e = e->next) {
+        if (e->info.type == type && strcmp(e->info.name, name) == 0)
+            return &e->info;
+    }
+    return NULL;
+}
+
+static void cache_info(struct sink_cache *cache, const struct device_info *info)
+{
+    struct cache_entry *entry = *find_entry(cache, info->type, info->index);
+
+    /* Answers to queries sent before our own writes would undo them. */
+    if (entry && entry->holds) {
+        entry->stale = 1;
+        return;
+    }
+
+    cache_update(cache, info);
+    notify(cache);
+}
+
+static void cache_sink_cb(pa_context *c, const pa_sink_info *info, int eol, void *raw)
+{
+    struct device_info sink;
+
+    if (eol != 0) return;
+    copy_sink_info(&sink, info);
+    cache_info(raw, &sink);
+}
+
+static void cache_source_cb(pa_context *c, const pa_source_info *info, int eol, void *raw)
+{
+    struct device_info source;
+
+    if (eol != 0) return;
+    copy_source_info(&source, info);
+    cache_info(raw, &source);
+}
+
+static void cache_server_cb(pa_context *c, const pa_server_info *info, void *raw)
+{
+    struct sink_cache *cache = raw;
+
+    snprintf(cache->default_sink, sizeof(cache->default_sink), "%s",
+             info && info->default_sink_name ? info->default_sink_name : "");
+    snprintf(cache->default_source, sizeof(cache->default_source), "%s",
+             info && info->default_source_name ? info->default_source_name : "");
+    notify(cache);
+}
+
+/* Runs however the op ends, so a lost answer can't disable the cache. */
+static void server_done_cb(struct pmixer_priv *priv, enum op_status status, void *raw)
+{
+    struct sink_cache *cache = raw;
+
+    cache->server_pending--;
+}
+
+static void request_server_info(struct sink_cache *cache)
+{
+    pa_operation *op = pa_context_get_server_info(cache->priv->context, cache_server_cb, cache);
+
+    cache->server_pending++;
+    check(track_op(cache->priv, op, "get_server_info", server_done_cb, cache) == 0,
+          "Unable to request server info.");
+    return;
+
+error:
+    cache->server_pending--;
+}
+
+static void cache_refresh(struct sink_cache *cache, enum target_type type, uint32_t index)
+{
+    pa_operation *op;
+
+    if (type == TARGET_SOURCE)
+        op = pa_context_get_source_info_by_index(cache->priv->context, index, cache_source_cb, cache);
+    else
+        op = pa_context_get_sink_info_by_index(cache->priv->context, index, cache_sink_cb, cache);
+    if (track_op(cache->priv, op, type == TARGET_SOURCE ? "get_source_info" : "get_sink_info", NULL, cache) != 0)
+        log_err("Unable to refresh %s %u", target_name(type), index);
+}
+
+void cache_hold(struct sink_cache *cache, const struct device_info *info)
+{
+    struct cache_entry *entry = set_entry(cache, info);
+
+    if (entry)
+        entry->holds++;
+}
+
+void cache_release(struct sink_cache *cache, enum target_type type, uint32_t index, int failed)
+{
+    struct cache_entry *entry = *find_entry(cache, type, index);
+
+    if (!entry || !entry->holds)
+        return;
+    if (failed)
+        entry->stale = 1;
+    if (--entry->holds == 0 && entry->stale) {
+        entry->stale = 0;
+        cache_refresh(cache, type, index);
+    }
+}
+
+static void subscribe_cb(pa_context *c, pa_subscription_event_type_t t, uint32_t index, void *raw)
+{
+    struct sink_cache *cache = raw;
+    enum target_type type = TARGET_SINK;
+
+    switch (t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
+        case PA_SUBSCRIPTION_EVENT_SOURCE:
+            type = TARGET_SOURCE;
+            /* fall through */
+        case PA_SUBSCRIPTION_EVENT_SINK:
+            if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
+                cache_remove(cache, type, index);
+                notify(cache);
+            } else {
+                cache_refresh(cache, type, index);
+            }
+            break;
+        case PA_SUBSCRIPTION_EVENT_SERVER:
+            request_server_info(cache);
+            break;
+    }
+}
+
+struct sink_cache *cache_new(struct pmixer_priv *priv)
+{
+    struct sink_cache *cache = calloc(1, sizeof(struct sink_cache));
+    pa_operation *op;
+
+    check_mem(cache);
+    cache->priv = priv;
+
+    pa_context_set_subscribe_callback(priv->context, subscribe_cb, cache);
+    op = pa_context_subscribe(priv->context,
+                              PA_SUBSCRIPTION_MASK_SINK | PA_SUBSCRIPTION_MASK_SOURCE | PA_SUBSCRIPTION_MASK_SERVER,
+                              NULL, NULL);
+    check(track_op(priv, op, "subscribe", NULL, NULL) == 0, "Unable to subscribe to device events.");
+    request_server_info(cache);
+    op = pa_context_get_sink_info_list(priv->context, cache_sink_cb, cache);
+    check(track_op(priv, op, "get_sink_info_list", NULL, cache) == 0, "Unable to list sinks.");
+    op = pa_context_get_source_info_list(priv->context, cache_source_cb, cache);
+    check(track_op(priv, op, "get_source_info_list", NULL, cache) == 0, "Unable to list sources.");
+    return cache;
+
+error:
+    if (cache)
+        cache_free(cache);
+    return NULL;
+}
+
+/* Called from the context state callback when the connection drops, before
+ * libpulse cancels what is still in flight, so our own ops go first. */
+void cache_free(struct sink_cache *cache)
+{
+    pa_context_set_subscribe_callback(cache->priv->context, NULL, NULL);
+    cancel_ops(cache->priv, cache);
+    while (cache->entries) {
+        struct cache_entry *entry = cache->entries;
+        cache->entries = entry->next;
+        free(entry);
+    }
+    free(cache);
+}
+
+int cache_start(struct pmixer_priv *priv)
+{
+    priv->cache = cache_new(priv);
+    return priv->cache ? 0 : -1;
+}
+
+void cache_stop(struct pmixer_priv *priv)
+{
+    if (priv->cache) {
+        cache_free(priv->cache);
+        priv->cache = NULL;
+    }
+}
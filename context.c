@@ -0,0 +1,157 @@
+#include <stdlib.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+void state_cb(pa_context *context, void* raw)
+{
+    struct pmixer_priv *priv = raw;
+
+    switch(pa_context_get_state(context)) {
+        case PA_CONTEXT_READY:
+            priv->state = CONNECTED;
+            break;
+        case PA_CONTEXT_FAILED:
+            priv->state = ERROR;
+            break;
+        case PA_CONTEXT_UNCONNECTED:
+        case PA_CONTEXT_AUTHORIZING:
+        case PA_CONTEXT_SETTING_NAME:
+        case PA_CONTEXT_CONNECTING:
+        case PA_CONTEXT_TERMINATED:
+            break;
+        default:
+            sentinel("pa_context in unexpected state.");
+            break;
+    }
+    if (priv->state_notify)
+        priv->state_notify(priv, priv->state_notify_raw);
+error:
+    return;
+}
+
+static void connect_timeout_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *raw)
+{
+    struct pmixer_priv *priv = raw;
+
+    if (priv->state == CONNECTING)
+        priv->state = TIMEOUT;
+}
+
+int new_context(struct pmixer_priv *priv, const char *name)
+{
+    priv->context = pa_context_new(priv->mainloop_api, name);
+    check_mem(priv->context);
+    priv->state = CONNECTING;
+    pa_context_set_state_callback(priv->context, state_cb, priv);
+    return 0;
+
+error:
+    return -1;
+}
+
+int setup_mainloop(struct pmixer_priv *priv)
+{
+    check_mem(priv->mainloop = pa_mainloop_new());
+    priv->mainloop_api = pa_mainloop_get_api(priv->mainloop);
+    check_mem(priv->mainloop_api);
+    return 0;
+
+error:
+    return -1;
+}
+
+int setup_context(struct pmixer_priv *priv)
+{
+    check(setup_mainloop(priv) == 0, "Can't create mainloop.");
+    check(new_context(priv, "pmixer") == 0, "Can't create context.");
+    return 0;
+
+error:
+    return -1;
+}
+
+int connect_server(struct pmixer_priv *priv, const char *server, int no_autospawn, unsigned timeout_ms)
+{
+    pa_time_event *timer = NULL;
+    int retval;
+
+    if (timeout_ms) {
+        struct timeval tv;
+        pa_timeval_add(pa_gettimeofday(&tv), timeout_ms * PA_USEC_PER_MSEC);
+        timer = priv->mainloop_api->time_new(priv->mainloop_api, &tv, connect_timeout_cb, priv);
+        check_mem(timer);
+    }
+
+    priv->server = server;
+    priv->no_autospawn = no_autospawn;
+    priv->connect_timeout_ms = timeout_ms;
+    priv->state = CONNECTING;
+    check(pa_context_connect(priv->context, server, no_autospawn ? PA_CONTEXT_NOAUTOSPAWN : PA_CONTEXT_NOFLAGS, NULL) >= 0,
+          "Can't connect: %s", pa_strerror(pa_context_errno(priv->context)));
+
+    while (priv->state == CONNECTING) {
+        pa_mainloop_iterate(priv->mainloop, 1, &retval);
+    }
+    if (priv->state == TIMEOUT) {
+        priv->timed_out = 1;
+        sentinel("Timed out connecting after %ums.", timeout_ms);
+    }
+    check(priv->state == CONNECTED, "Can't connect: %s", pa_strerror(pa_context_errno(priv->context)));
+
+    if (timer)
+        priv->mainloop_api->time_free(timer);
+    return 0;
+
+error:
+    if (timer)
+        priv->mainloop_api->time_free(timer);
+    return -1;
+}
+
+/* A fresh context each time: a failed one can't be connected again. */
+int start_connect(struct pmixer_priv *priv)
+{
+    if (priv->context) {
+        pa_context_set_state_callback(priv->context, NULL, NULL);
+        pa_context_unref(priv->context);
+        priv->context = NULL;
+    }
+    check(new_context(priv, "pmixer") == 0, "Can't create context.");
+    check(pa_context_connect(priv->context, priv->server,
+                             priv->no_autospawn ? PA_CONTEXT_NOAUTOSPAWN : PA_CONTEXT_NOFLAGS, NULL) >= 0,
+          "Can't reconnect: %s", pa_strerror(pa_context_errno(priv->context)));
+    return 0;
+
+error:
+    return -1;
+}
+
+void stop_connect(struct pmixer_priv *priv)
+{
+    pa_context_set_state_callback(priv->context, NULL, NULL);
+    pa_context_disconnect(priv->context);
+}
+
+const char *server_error(struct pmixer_priv *priv)
+{
+    return pa_strerror(pa_context_errno(priv->context));
+}
+
+void teardown_context(struct pmixer_priv *priv)
+{
+    if (priv->context) {
+        if (priv->state == CONNECTED || priv->state == TIMEOUT)
+            pa_context_disconnect(priv->context);
+        pa_context_unref(priv->context);
+        priv->context = NULL;
+    }
+    free_request_pool(priv);
+    if (priv->mainloop_api)
+        free_op_pool(priv);
+    if (priv->mainloop) {
+        pa_mainloop_free(priv->mainloop);
+        priv->mainloop = NULL;
+        priv->mainloop_api = NULL;
+    }
+}
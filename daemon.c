@@ -0,0 +1,576 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+#define REQUEST_MAX 64
+#define QUEUE_MAX 64
+#define LISTEN_FDS_START 3
+
+struct client {
+    struct daemon *daemon;
+    int fd;
+    struct loop_io *io;
+    char buf[REQUEST_MAX];
+    size_t len;
+    enum target_type type;
+    int bulk;
+    struct command command;
+    const char *dump_name;
+    char *dump;
+    size_t dump_len;
+    size_t dump_sent;
+    struct client *prev;
+    struct client *next;
+};
+
+struct client_list {
+    struct client *head;
+    struct client *tail;
+    size_t len;
+};
+
+/* Sinks and sources are coalesced and written independently. */
+struct lane {
+    struct daemon *daemon;
+    enum target_type type;
+    struct client_list pending;
+    struct client_list inflight;
+    struct loop_timer *window_timer;
+    int window_open;
+    int window_expired;
+};
+
+struct daemon {
+    struct pmixer_priv *priv;
+    const struct daemon_options *options;
+    int listen_fd;
+    int activated;
+    struct loop_io *listen_io;
+    struct loop_timer *idle_timer;
+    int idle_expired;
+    struct client_list reading;
+    struct client_list ready;
+    struct lane lanes[2];
+    struct client_list bulk_pending;
+    struct client_list bulk_running;
+    struct client_list sending;
+    struct client *spare_clients;
+    struct command *scratch;
+    size_t scratch_alloc;
+    int quit;
+};
+
+static void list_append(struct client_list *list, struct client *client)
+{
+    client->prev = list->tail;
+    client->next = NULL;
+    if (list->tail)
+        list->tail->next = client;
+    else
+        list->head = client;
+    list->tail = client;
+    list->len++;
+}
+
+static void list_remove(struct client_list *list, struct client *client)
+{
+    if (client->prev)
+        client->prev->next = client->next;
+    else
+        list->head = client->next;
+    if (client->next)
+        client->next->prev = client->prev;
+    else
+        list->tail = client->prev;
+    client->prev = client->next = NULL;
+    list->len--;
+}
+
+static void client_free(struct daemon *d, struct client *client)
+{
+    if (client->io)
+        loop_io_free(client->io);
+    close(client->fd);
+    free(client->dump);
+    client->next = d->spare_clients;
+    d->spare_clients = client;
+}
+
+static struct client *client_new(struct daemon *d)
+{
+    struct client *client = d->spare_clients;
+
+    if (!client)
+        return calloc(1, sizeof(struct client));
+    d->spare_clients = client->next;
+    memset(client, 0, sizeof(struct client));
+    return client;
+}
+
+static void flush_dump(struct client *client);
+
+static void client_cb(struct loop_io *io, int fd, void *raw)
+{
+    struct client *client = raw;
+    ssize_t n;
+
+    if (client->dump) {
+        flush_dump(client);
+        return;
+    }
+
+    n = read(fd, client->buf + client->len, sizeof(client->buf) - 1 - client->len);
+    if (n < 0 && errno == EAGAIN)
+        return;
+
+    if (n > 0)
+        client->len += n;
+    client->buf[client->len] = '\0';
+
+    if (n <= 0 || strchr(client->buf, '\n') || client->len == sizeof(client->buf) - 1) {
+        loop_io_enable(io, 0);
+        list_remove(&client->daemon->reading, client);
+        list_append(&client->daemon->ready, client);
+    }
+}
+
+static void idle_cb(struct loop_timer *timer, void *raw)
+{
+    struct daemon *d = raw;
+    d->idle_expired = 1;
+}
+
+static void touch_idle(struct daemon *d)
+{
+    if (d->options->idle_exit_ms == 0)
+        return;
+
+    if (!d->idle_timer)
+        d->idle_timer = loop_timer_new(d->priv, idle_cb, d);
+    if (d->idle_timer)
+        loop_timer_arm(d->idle_timer, d->options->idle_exit_ms);
+    d->idle_expired = 0;
+}
+
+/* Clients still sending their request or reading a dump don't count: one
+ * that never finishes would keep us up forever. Idle exit closes them. */
+static int busy(const struct daemon *d)
+{
+    for (int i = 0; i < 2; i++) {
+        if (d->lanes[i].pending.head || d->lanes[i].inflight.head)
+            return 1;
+    }
+    return d->ready.head || d->bulk_pending.head || d->bulk_running.head ||
+           d->priv->inflight > 0;
+}
+
+static void accept_cb(struct loop_io *io, int fd, void *raw)
+{
+    struct daemon *d = raw;
+    struct client *client = NULL;
+    int client_fd;
+
+    touch_idle(d);
+    client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    check(client_fd >= 0, "Can't accept connection.");
+
+    client = client_new(d);
+    check_mem(client);
+    client->daemon = d;
+    client->fd = client_fd;
+    client->io = loop_io_new(d->priv, client_fd, LOOP_IN, client_cb, client);
+    check_mem(client->io);
+
+    list_append(&d->reading, client);
+    return;
+
+error:
+    if (client) {
+        client->next = d->spare_clients;
+        d->spare_clients = client;
+    }
+    if (client_fd >= 0)
+        close(client_fd);
+}
+
+static void reply(struct client *client, const char *msg)
+{
+    if (send(client->fd, msg, strlen(msg), MSG_NOSIGNAL) < 0)
+        log_warn("Can't reply to client.");
+}
+
+static void window_cb(struct loop_timer *timer, void *raw)
+{
+    struct lane *lane = raw;
+    lane->window_expired = 1;
+}
+
+static void open_window(struct lane *lane)
+{
+    struct daemon *d = lane->daemon;
+
+    if (d->options->coalesce_ms == 0)
+        return;
+
+    if (!lane->window_timer)
+        lane->window_timer = loop_timer_new(d->priv, window_cb, lane);
+    if (lane->window_timer)
+        loop_timer_arm(lane->window_timer, d->options->coalesce_ms);
+    lane->window_open = lane->window_timer != NULL;
+    lane->window_expired = 0;
+}
+
+static void reply_all(struct daemon *d, struct client_list *list, const char *msg)
+{
+    while (list->head) {
+        struct client *client = list->head;
+        list_remove(list, client);
+        reply(client, msg);
+        client_free(d, client);
+    }
+}
+
+static void flush_done_cb(struct pmixer_priv *priv, int rc, const struct target *targets, size_t ntargets, void *raw)
+{
+    struct lane *lane = raw;
+
+    reply_all(lane->daemon, &lane->inflight,
+              rc == 0 ? "ok\n" : rc == -ETIMEDOUT ? "error timeout\n" : "error command failed\n");
+}
+
+static void flush_pending(struct lane *lane)
+{
+    struct daemon *d = lane->daemon;
+    struct selector selector = { lane->type, NULL };
+    size_t n = 0;
+
+    if (lane->pending.len > d->scratch_alloc) {
+        struct command *grown = realloc(d->scratch, lane->pending.len * sizeof(struct command));
+        check_mem(grown);
+        d->scratch = grown;
+        d->scratch_alloc = lane->pending.len;
+    }
+    for (struct client *c = lane->pending.head; c; c = c->next)
+        d->scratch[n++] = c->command;
+
+    if (n > 1)
+        debug("Coalesced %zu %s commands", n, target_name(lane->type));
+
+    metrics_flush(n);
+    lane->inflight = lane->pending;
+    lane->pending = (struct client_list){ 0 };
+    if (submit_commands(d->priv, &selector, d->scratch, n, flush_done_cb, lane) != 0)
+        reply_all(d, &lane->inflight, "error command failed\n");
+    return;
+
+error:
+    reply_all(d, &lane->pending, "error out of memory\n");
+}
+
+static void process_lane(struct lane *lane)
+{
+    if (lane->inflight.head || (lane->window_open && !lane->window_expired))
+        return;
+
+    if (lane->pending.head) {
+        flush_pending(lane);
+        open_window(lane);
+    } else {
+        lane->window_open = 0;
+    }
+}
+
+/* Dumps may be larger than the socket buffer, so they go out as the client
+ * reads them rather than holding up the loop. */
+static void flush_dump(struct client *client)
+{
+    struct daemon *d = client->daemon;
+    ssize_t n = send(client->fd, client->dump + client->dump_sent, client->dump_len - client->dump_sent,
+                     MSG_NOSIGNAL);
+
+    if (n < 0 && errno == EAGAIN)
+        return;
+    if (n < 0)
+        log_warn("Can't send %s.", client->dump_name);
+    else if ((client->dump_sent += n) < client->dump_len)
+        return;
+
+    list_remove(&d->sending, client);
+    client_free(d, client);
+}
+
+static void send_dump(struct daemon *d, struct client *client, const char *name, void (*dump)(FILE *f))
+{
+    FILE *f = open_memstream(&client->dump, &client->dump_len);
+
+    check(f, "Can't build %s.", name);
+    dump(f);
+    fclose(f);
+
+    client->dump_name = name;
+    list_append(&d->sending, client);
+    loop_io_enable(client->io, LOOP_OUT);
+    return;
+
+error:
+    client_free(d, client);
+}
+
+static int prefix(char **line, const char *word)
+{
+    size_t len = strlen(word);
+
+    *line += strspn(*line, " \t");
+    if (strncmp(*line, word, len) != 0 || (*line)[len] != ' ')
+        return 0;
+    *line += len;
+    return 1;
+}
+
+/* Optional "bulk" and "source" prefixes mark background work and address
+ * the default source instead of the sink. */
+static int parse_request(struct client *client)
+{
+    char *line = client->buf;
+
+    client->bulk = prefix(&line, "bulk");
+    client->type = prefix(&line, "source") ? TARGET_SOURCE : TARGET_SINK;
+    return parse_command_line(line, &client->command);
+}
+
+static void bulk_done_cb(struct pmixer_priv *priv, int rc, const struct target *targets, size_t ntargets, void *raw)
+{
+    struct client *client = raw;
+
+    list_remove(&client->daemon->bulk_running, client);
+    reply(client, rc == 0 ? "ok\n" : rc == -ETIMEDOUT ? "error timeout\n" : "error command failed\n");
+    client_free(client->daemon, client);
+}
+
+/* Bulk commands are applied one by one, in order and uncoalesced, but only
+ * a few at a time: the server answers in order, so every bulk write in
+ * flight is one more a key press has to wait behind. */
+static void process_bulk(struct daemon *d)
+{
+    while (d->bulk_pending.head && d->bulk_running.len < d->options->bulk_inflight) {
+        struct client *client = d->bulk_pending.head;
+        struct selector selector = { client->type, NULL };
+
+        list_remove(&d->bulk_pending, client);
+        list_append(&d->bulk_running, client);
+        if (submit_commands(d->priv, &selector, &client->command, 1, bulk_done_cb, client) != 0) {
+            list_remove(&d->bulk_running, client);
+            reply(client, "error command failed\n");
+            client_free(d, client);
+        }
+    }
+}
+
+static void process_clients(struct daemon *d)
+{
+    while (d->ready.head) {
+        struct client *client = d->ready.head;
+
+        list_remove(&d->ready, client);
+        client->buf[strcspn(client->buf, "\r\n")] = '\0';
+
+        if (strcmp(client->buf, "trace") == 0) {
+            send_dump(d, client, "trace", trace_dump);
+            continue;
+        }
+        if (strcmp(client->buf, "metrics") == 0) {
+            send_dump(d, client, "metrics", metrics_dump);
+            continue;
+        }
+        if (parse_request(client) != 0) {
+            metrics_invalid();
+            reply(client, "error invalid command\n");
+            client_free(d, client);
+            continue;
+        }
+        /* While reconnecting, commands wait for the server, up to a point. */
+        if (d->priv->state != CONNECTED &&
+            d->lanes[0].pending.len + d->lanes[1].pending.len + d->bulk_pending.len >= QUEUE_MAX) {
+            metrics_rejected();
+            reply(client, "error disconnected\n");
+            client_free(d, client);
+            continue;
+        }
+        if (client->bulk)
+            list_append(&d->bulk_pending, client);
+        else
+            list_append(&d->lanes[client->type == TARGET_SOURCE].pending, client);
+    }
+
+    if (d->priv->state != CONNECTED)
+        return;
+    /* Interactive writes always go out ahead of any bulk still queued. */
+    for (int i = 0; i < 2; i++)
+        process_lane(&d->lanes[i]);
+    process_bulk(d);
+}
+
+static int session_up(struct pmixer_priv *priv, void *raw)
+{
+    return cache_start(priv);
+}
+
+static int session_down(struct pmixer_priv *priv, void *raw)
+{
+    cache_stop(priv);
+    return 0;
+}
+
+static void quit_cb(int sig, void *raw)
+{
+    struct daemon *d = raw;
+    d->quit = 1;
+}
+
+static void trace_cb(int sig, void *raw)
+{
+    trace_dump(stderr);
+}
+
+/* With systemd socket activation the bound socket is already open as fd 3. */
+static int activated_socket(void)
+{
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+
+    if (!pid || !fds || strtoul(pid, NULL, 10) != (unsigned long)getpid())
+        return -1;
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    check(strtoul(fds, NULL, 10) == 1, "Expected one socket from LISTEN_FDS, got %s.", fds);
+    check(fcntl(LISTEN_FDS_START, F_SETFD, FD_CLOEXEC) == 0, "Can't use the activated socket.");
+    return LISTEN_FDS_START;
+
+error:
+    return -1;
+}
+
+static int listen_socket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd = -1;
+
+    check(strlen(path) < sizeof(addr.sun_path), "Socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    check(fd >= 0, "Can't create socket.");
+    unlink(path);
+    check(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0, "Can't bind %s", path);
+    check(listen(fd, 16) == 0, "Can't listen on %s", path);
+    return fd;
+
+error:
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+int run_daemon(struct pmixer_priv *priv, const struct daemon_options *options)
+{
+    struct daemon d = { .priv = priv, .options = options, .listen_fd = -1 };
+    const char *socket_path = options->socket_path;
+    struct reconnect *reconnect = NULL;
+    int retval;
+
+    d.lanes[0] = (struct lane){ .daemon = &d, .type = TARGET_SINK };
+    d.lanes[1] = (struct lane){ .daemon = &d, .type = TARGET_SOURCE };
+
+    check(loop_signals_init(priv) == 0, "Can't set up signal handling.");
+    loop_signal(priv, SIGINT, quit_cb, &d);
+    loop_signal(priv, SIGTERM, quit_cb, &d);
+    loop_signal(priv, SIGUSR1, trace_cb, NULL);
+
+    check(cache_start(priv) == 0, "Can't set up sink cache.");
+    check(wait_ops(priv) == 0, "Unable to populate sink cache.");
+    reconnect = reconnect_new(priv, session_up, session_down, &d);
+    check(reconnect, "Can't set up reconnect.");
+
+    d.listen_fd = activated_socket();
+    d.activated = d.listen_fd >= 0;
+    if (!d.activated)
+        d.listen_fd = listen_socket(socket_path);
+    check(d.listen_fd >= 0, "Can't listen for commands.");
+    d.listen_io = loop_io_new(priv, d.listen_fd, LOOP_IN, accept_cb, &d);
+    check_mem(d.listen_io);
+    if (d.activated)
+        log_info("Listening on the activated socket");
+    else
+        log_info("Listening on %s", socket_path);
+    touch_idle(&d);
+
+    while (!d.quit) {
+        if (loop_iterate(priv) < 0)
+            break;
+        process_clients(&d);
+        if (d.idle_expired) {
+            if (busy(&d)) {
+                touch_idle(&d);
+            } else {
+                log_info("Idle for %ums, exiting.", options->idle_exit_ms);
+                break;
+            }
+        }
+    }
+
+    retval = 0;
+    goto out;
+
+error:
+    retval = -1;
+out:
+    if (priv->state == CONNECTED)
+        wait_ops(priv);
+    if (reconnect)
+        reconnect_free(reconnect);
+    struct client_list *lists[] = {
+        &d.reading, &d.ready,
+        &d.lanes[0].pending, &d.lanes[0].inflight,
+        &d.lanes[1].pending, &d.lanes[1].inflight,
+        &d.bulk_pending, &d.bulk_running, &d.sending,
+    };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        while (lists[i]->head) {
+            struct client *client = lists[i]->head;
+            list_remove(lists[i], client);
+            client_free(&d, client);
+        }
+    }
+    while (d.spare_clients) {
+        struct client *client = d.spare_clients;
+        d.spare_clients = client->next;
+        free(client);
+    }
+    free(d.scratch);
+    for (int i = 0; i < 2; i++) {
+        if (d.lanes[i].window_timer)
+            loop_timer_free(d.lanes[i].window_timer);
+    }
+    if (d.idle_timer)
+        loop_timer_free(d.idle_timer);
+    if (d.listen_io)
+        loop_io_free(d.listen_io);
+    if (d.listen_fd >= 0) {
+        close(d.listen_fd);
+        if (!d.activated)
+            unlink(socket_path);
+    }
+    cache_stop(priv);
+    loop_signals_done(priv);
+    return retval;
+}
@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <math.h>
+#include <signal.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+struct fade;
+
+struct fade_target {
+    struct fade *fade;
+    uint32_t index;
+    pa_cvolume start;
+    pa_cvolume end;
+    pa_cvolume current;
+    double sent;
+    int busy;
+};
+
+struct fade {
+    struct pmixer_priv *priv;
+    enum target_type type;
+    struct fade_target *targets;
+    size_t ntargets;
+    unsigned percent;
+    uint64_t duration_us;
+    uint64_t interval_us;
+    uint64_t started;
+    uint64_t next;
+    double progress;
+    pa_time_event *tick;
+    int started_ramp;
+    int failed;
+    int quit;
+};
+
+static void interpolate(pa_cvolume *volume, const pa_cvolume *start, const pa_cvolume *end, double progress)
+{
+    volume->channels = start->channels;
+    for (unsigned c = 0; c < start->channels; c++) {
+        double delta = (double)end->values[c] - (double)start->values[c];
+        volume->values[c] = (pa_volume_t)lround(start->values[c] + delta * progress);
+    }
+}
+
+static void success_cb(pa_context *c, int success, void *raw)
+{
+    struct fade *f = raw;
+
+    if (!success)
+        f->failed = 1;
+}
+
+static void write_volume(struct fade *f, struct fade_target *t);
+
+static void write_done_cb(struct pmixer_priv *priv, enum op_status status, void *raw)
+{
+    struct fade_target *t = raw;
+    struct fade *f = t->fade;
+
+    t->busy = 0;
+    if (status != OP_DONE)
+        f->failed = 1;
+    /* A write still in flight at the last tick must not leave us short. */
+    if (!f->failed && f->progress >= 1.0 && t->sent < 1.0)
+        write_volume(f, t);
+}
+
+static void write_volume(struct fade *f, struct fade_target *t)
+{
+    pa_cvolume volume;
+    pa_operation *op;
+
+    interpolate(&volume, &t->start, &t->end, f->progress);
+    t->sent = f->progress;
+    if (pa_cvolume_equal(&volume, &t->current))
+        return;
+    t->current = volume;
+
+    if (f->type == TARGET_SINK_INPUT)
+        op = pa_context_set_sink_input_volume(f->priv->context, t->index, &volume, success_cb, f);
+    else if (f->type == TARGET_SOURCE)
+        op = pa_context_set_source_volume_by_index(f->priv->context, t->index, &volume, success_cb, f);
+    else
+        op = pa_context_set_sink_volume_by_index(f->priv->context, t->index, &volume, success_cb, f);
+    t->busy = 1;
+    if (track_op(f->priv, op, "set_volume", write_done_cb, t) != 0) {
+        t->busy = 0;
+        f->failed = 1;
+    }
+}
+
+static void tick_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *raw)
+{
+    struct fade *f = raw;
+    uint64_t now = now_usec();
+    struct timeval next;
+
+    f->progress = f->duration_us ? (double)(now - f->started) / f->duration_us : 1.0;
+    if (f->progress > 1.0)
+        f->progress = 1.0;
+
+    /* Targets with a write in flight skip this step rather than queue behind it. */
+    for (size_t i = 0; i < f->ntargets; i++) {
+        if (!f->targets[i].busy)
+            write_volume(f, &f->targets[i]);
+    }
+
+    if (f->progress >= 1.0)
+        return;
+
+    /* Steps are scheduled from the start time so late ticks do not push back the deadline. */
+    while (f->next <= now)
+        f->next += f->interval_us;
+    if (f->next > f->started + f->duration_us)
+        f->next = f->started + f->duration_us;
+    pa_timeval_add(pa_gettimeofday(&next), f->next - now);
+    api->time_restart(e, &next);
+}
+
+static void lookup_cb(struct pmixer_priv *priv, int rc, const struct target *targets, size_t ntargets, void *raw)
+{
+    struct fade *f = raw;
+    struct command set = { CMD_SET, f->percent };
+    pa_mainloop_api *api = priv->mainloop_api;
+    struct timeval tv;
+
+    check(rc == 0, "Can't read the current volume.");
+    f->targets = calloc(ntargets, sizeof(struct fade_target));
+    check_mem(f->targets);
+    f->ntargets = ntargets;
+
+    for (size_t i = 0; i < ntargets; i++) {
+        struct fade_target *t = &f->targets[i];
+        struct device_info end = targets[i].before;
+
+        apply_command(&end, &set);
+        t->fade = f;
+        t->index = targets[i].before.index;
+        t->start = targets[i].before.volume;
+        t->current = t->start;
+        t->end = end.volume;
+    }
+
+    f->started = f->next = now_usec();
+    f->started_ramp = 1;
+    f->tick = api->time_new(api, pa_gettimeofday(&tv), tick_cb, f);
+    check_mem(f->tick);
+    return;
+
+error:
+    f->failed = 1;
+}
+
+static void quit_cb(pa_mainloop_api *api, pa_signal_event *e, int sig, void *raw)
+{
+    struct fade *f = raw;
+    f->quit = 1;
+}
+
+int run_fade(struct pmixer_priv *priv, const struct selector *selector,
+             unsigned percent, unsigned duration_ms, unsigned rate)
+{
+    struct fade f = { 0 };
+    int retval;
+
+    f.priv = priv;
+    f.type = selector->type;
+    f.percent = percent;
+    f.duration_us = (uint64_t)duration_ms * PA_USEC_PER_MSEC;
+    f.interval_us = PA_USEC_PER_SEC / rate;
+
+    check(pa_signal_init(priv->mainloop_api) == 0, "Can't set up signal handling.");
+    pa_signal_new(SIGINT, quit_cb, &f);
+    pa_signal_new(SIGTERM, quit_cb, &f);
+
+    check(submit_commands(priv, selector, NULL, 0, lookup_cb, &f) == 0, "Can't find fade targets.");
+
+    while (!f.quit && !f.failed && priv->state == CONNECTED &&
+           !(f.started_ramp && f.progress >= 1.0 && priv->inflight == 0)) {
+        if (pa_mainloop_iterate(priv->mainloop, 1, &retval) < 0)
+            break;
+    }
+    check(!f.failed && priv->state == CONNECTED, "Fade failed.");
+    check(!f.quit, "Fade interrupted.");
+
+    retval = 0;
+    goto out;
+
+error:
+    retval = -1;
+out:
+    if (priv->state == CONNECTED)
+        wait_ops(priv);
+    if (f.tick)
+        priv->mainloop_api->time_free(f.tick);
+    free(f.targets);
+    pa_signal_done();
+    return retval;
+}
@@ -0,0 +1,244 @@
+#include <stdlib.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+enum host_phase {
+    HOST_WAITING,
+    HOST_CONNECTING,
+    HOST_RUNNING,
+    HOST_DONE,
+};
+
+struct fanout;
+
+struct host {
+    struct fanout *fan;
+    const char *server;
+    struct pmixer_priv priv;
+    enum host_phase phase;
+    pa_time_event *connect_timer;
+    size_t pending;
+    int rc;
+    uint64_t started;
+    uint64_t connected;
+    uint64_t finished;
+};
+
+struct fanout {
+    struct pmixer_priv *priv;
+    const struct fanout_options *options;
+    const struct batch *batch;
+    struct host *hosts;
+    size_t nhosts;
+    size_t next;
+    size_t active;
+    size_t done;
+    int stopping;
+};
+
+static void start_hosts(struct fanout *fan);
+
+static void finish_host(struct host *host, int rc)
+{
+    struct fanout *fan = host->fan;
+
+    if (host->phase == HOST_DONE)
+        return;
+    host->phase = HOST_DONE;
+    host->rc = rc;
+    host->finished = now_usec();
+    if (host->connect_timer) {
+        fan->priv->mainloop_api->time_free(host->connect_timer);
+        host->connect_timer = NULL;
+    }
+    host->priv.state_notify = NULL;
+    pa_context_disconnect(host->priv.context);
+
+    fan->active--;
+    fan->done++;
+    if (!fan->stopping)
+        start_hosts(fan);
+}
+
+static void command_done_cb(struct pmixer_priv *priv, int rc, const struct target *targets, size_t ntargets, void *raw)
+{
+    struct host *host = raw;
+
+    if (host->phase != HOST_RUNNING)
+        return;
+    if (host->rc == 0)
+        host->rc = rc;
+    if (--host->pending == 0)
+        finish_host(host, host->rc);
+}
+
+static void host_state_cb(struct pmixer_priv *priv, void *raw)
+{
+    struct host *host = raw;
+    struct fanout *fan = host->fan;
+
+    if (host->phase != HOST_CONNECTING)
+        return;
+
+    if (priv->state == CONNECTED) {
+        host->connected = now_usec();
+        host->phase = HOST_RUNNING;
+        if (host->connect_timer) {
+            fan->priv->mainloop_api->time_free(host->connect_timer);
+            host->connect_timer = NULL;
+        }
+        /* Every run goes out at once; the host is done with the last answer. */
+        for (size_t i = 0; i < fan->batch->nruns; i++) {
+            const struct batch_run *run = &fan->batch->runs[i];
+
+            if (submit_commands(priv, &run->selector, run->commands, run->count, command_done_cb, host) == 0)
+                host->pending++;
+            else
+                host->rc = -1;
+        }
+        if (host->pending == 0)
+            finish_host(host, -1);
+    } else if (priv->state == ERROR) {
+        log_err("%s: %s", host->server, pa_strerror(pa_context_errno(priv->context)));
+        finish_host(host, -1);
+    }
+}
+
+static void connect_timeout_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *raw)
+{
+    struct host *host = raw;
+
+    log_err("%s: timed out connecting.", host->server);
+    host->priv.timed_out = 1;
+    finish_host(host, -ETIMEDOUT);
+}
+
+static void start_host(struct fanout *fan, struct host *host)
+{
+    pa_mainloop_api *api = fan->priv->mainloop_api;
+
+    host->phase = HOST_CONNECTING;
+    host->started = now_usec();
+    fan->active++;
+
+    host->priv.mainloop = fan->priv->mainloop;
+    host->priv.mainloop_api = api;
+    host->priv.op_timeout_ms = fan->priv->op_timeout_ms;
+    check(new_context(&host->priv, "pmixer") == 0, "%s: can't create context.", host->server);
+    host->priv.state_notify = host_state_cb;
+    host->priv.state_notify_raw = host;
+
+    if (fan->options->connect_timeout_ms) {
+        struct timeval tv;
+        pa_timeval_add(pa_gettimeofday(&tv), fan->options->connect_timeout_ms * PA_USEC_PER_MSEC);
+        host->connect_timer = api->time_new(api, &tv, connect_timeout_cb, host);
+        check_mem(host->connect_timer);
+    }
+
+    check(pa_context_connect(host->priv.context, host->server,
+                             fan->options->no_autospawn ? PA_CONTEXT_NOAUTOSPAWN : PA_CONTEXT_NOFLAGS, NULL) >= 0,
+          "%s: %s", host->server, pa_strerror(pa_context_errno(host->priv.context)));
+    return;
+
+error:
+    if (host->priv.context)
+        finish_host(host, -1);
+    else {
+        host->phase = HOST_DONE;
+        host->rc = -1;
+        fan->active--;
+        fan->done++;
+    }
+}
+
+static void start_hosts(struct fanout *fan)
+{
+    while (fan->next < fan->nhosts && (!fan->options->parallel || fan->active < fan->options->parallel))
+        start_host(fan, &fan->hosts[fan->next++]);
+}
+
+static void report(struct fanout *fan, uint64_t started)
+{
+    size_t ok = 0;
+
+    for (size_t i = 0; i < fan->nhosts; i++) {
+        struct host *host = &fan->hosts[i];
+        const char *status = host->rc == 0 ? "ok" : host->rc == -ETIMEDOUT ? "timeout" : "failed";
+
+        ok += host->rc == 0;
+        if (!host->started) {
+            printf("%-32s skipped\n", host->server);
+            continue;
+        }
+        printf("%-32s %-8s", host->server, status);
+        if (host->connected)
+            printf(" connect %8.1fms  command %8.1fms\n",
+                   (host->connected - host->started) / 1000.0, (host->finished - host->connected) / 1000.0);
+        else
+            printf(" connect %8.1fms\n", (host->finished - host->started) / 1000.0);
+    }
+    printf("%zu/%zu ok in %.1fms\n", ok, fan->nhosts, (now_usec() - started) / 1000.0);
+}
+
+int run_fanout(struct pmixer_priv *priv, const struct fanout_options *options, const struct batch *batch)
+{
+    struct fanout fan = { 0 };
+    uint64_t started = now_usec();
+    int timeouts = 0;
+    int failures = 0;
+    int retval;
+
+    fan.priv = priv;
+    fan.options = options;
+    fan.batch = batch;
+    fan.nhosts = options->nservers;
+    fan.hosts = calloc(fan.nhosts, sizeof(struct host));
+    check_mem(fan.hosts);
+    for (size_t i = 0; i < fan.nhosts; i++) {
+        fan.hosts[i].fan = &fan;
+        fan.hosts[i].server = options->servers[i];
+    }
+
+    start_hosts(&fan);
+    while (fan.done < fan.nhosts) {
+        if (pa_mainloop_iterate(priv->mainloop, 1, &retval) < 0)
+            break;
+    }
+
+    /* Let cancelled operations unwind before the contexts go away. Hosts
+     * still queued behind --parallel never connected, so there is nothing
+     * to tear down for them. */
+    fan.stopping = 1;
+    for (size_t i = 0; i < fan.nhosts; i++) {
+        struct host *host = &fan.hosts[i];
+
+        if (host->phase == HOST_WAITING) {
+            host->phase = HOST_DONE;
+            host->rc = -1;
+            fan.done++;
+        } else if (host->phase != HOST_DONE)
+            finish_host(host, -1);
+        while (host->priv.inflight > 0 && pa_mainloop_iterate(priv->mainloop, 1, &retval) >= 0)
+            ;
+    }
+
+    report(&fan, started);
+    for (size_t i = 0; i < fan.nhosts; i++) {
+        struct host *host = &fan.hosts[i];
+
+        failures += host->rc != 0;
+        timeouts += host->rc == -ETIMEDOUT;
+        if (host->priv.context)
+            pa_context_unref(host->priv.context);
+        free_request_pool(&host->priv);
+        free_op_pool(&host->priv);
+    }
+    free(fan.hosts);
+
+    priv->timed_out = failures > 0 && failures == timeouts;
+    return failures ? -1 : 0;
+
+error:
+    return -1;
+}
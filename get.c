@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+struct buffer {
+    char *data;
+    size_t len;
+    size_t alloc;
+    int failed;
+};
+
+struct get {
+    enum output_format format;
+    struct buffer out;
+    int rc;
+};
+
+static void append(struct buffer *b, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (b->failed)
+        return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(b->data + b->len, b->alloc - b->len, fmt, ap);
+    va_end(ap);
+    check(n >= 0, "Can't format output.");
+
+    if (b->len + n >= b->alloc) {
+        size_t alloc = b->alloc ? b->alloc : 512;
+        char *grown;
+
+        while (alloc <= b->len + n)
+            alloc *= 2;
+        grown = realloc(b->data, alloc);
+        check_mem(grown);
+        b->data = grown;
+        b->alloc = alloc;
+
+        va_start(ap, fmt);
+        vsnprintf(b->data + b->len, b->alloc - b->len, fmt, ap);
+        va_end(ap);
+    }
+    b->len += n;
+    return;
+
+error:
+    b->failed = 1;
+}
+
+static unsigned channel_percent(pa_volume_t v)
+{
+    return ((uint64_t)v * 100 + PA_VOLUME_NORM / 2) / PA_VOLUME_NORM;
+}
+
+static void append_json_string(struct buffer *b, const char *s)
+{
+    append(b, "\"");
+    for (; *s; s++) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\')
+            append(b, "\\%c", c);
+        else if (c < 0x20)
+            append(b, "\\u%04x", c);
+        else
+            append(b, "%c", c);
+    }
+    append(b, "\"");
+}
+
+static void append_shell_string(struct buffer *b, const char *s)
+{
+    append(b, "'");
+    for (; *s; s++) {
+        if (*s == '\'')
+            append(b, "'\\''");
+        else
+            append(b, "%c", *s);
+    }
+    append(b, "'");
+}
+
+static void format_plain(struct buffer *b, const struct device_info *info)
+{
+    append(b, "%u\t%s\t%u%%\t", info->index, info->name, volume_percent(&info->volume));
+    for (unsigned c = 0; c < info->volume.channels; c++)
+        append(b, "%s%u%%", c ? "," : "", channel_percent(info->volume.values[c]));
+    append(b, "\t%s\n", info->mute ? "muted" : "unmuted");
+}
+
+static void format_json(struct buffer *b, const struct device_info *info, size_t n)
+{
+    append(b, "%s{\"index\":%u,\"name\":", n ? "," : "", info->index);
+    append_json_string(b, info->name);
+    append(b, ",\"volume\":[");
+    for (unsigned c = 0; c < info->volume.channels; c++)
+        append(b, "%s%u", c ? "," : "", channel_percent(info->volume.values[c]));
+    append(b, "],\"percent\":%u,\"mute\":%s}", volume_percent(&info->volume), info->mute ? "true" : "false");
+}
+
+static void format_shell(struct buffer *b, const struct device_info *info, size_t n)
+{
+    append(b, "PMIXER_%zu_INDEX=%u\nPMIXER_%zu_NAME=", n, info->index, n);
+    append_shell_string(b, info->name);
+    append(b, "\nPMIXER_%zu_VOLUME='", n);
+    for (unsigned c = 0; c < info->volume.channels; c++)
+        append(b, "%s%u", c ? " " : "", channel_percent(info->volume.values[c]));
+    append(b, "'\nPMIXER_%zu_PERCENT=%u\nPMIXER_%zu_MUTE=%d\n", n, volume_percent(&info->volume), n, info->mute);
+}
+
+static void get_cb(struct pmixer_priv *priv, int rc, const struct target *targets, size_t ntargets, void *raw)
+{
+    struct get *g = raw;
+
+    g->rc = rc;
+    if (rc != 0)
+        return;
+
+    if (g->format == FORMAT_JSON)
+        append(&g->out, "[");
+    else if (g->format == FORMAT_SHELL)
+        append(&g->out, "PMIXER_COUNT=%zu\n", ntargets);
+
+    for (size_t i = 0; i < ntargets; i++) {
+        switch (g->format) {
+            case FORMAT_PLAIN:
+                format_plain(&g->out, &targets[i].before);
+                break;
+            case FORMAT_JSON:
+                format_json(&g->out, &targets[i].before, i);
+                break;
+            case FORMAT_SHELL:
+                format_shell(&g->out, &targets[i].before, i);
+                break;
+        }
+    }
+
+    if (g->format == FORMAT_JSON)
+        append(&g->out, "]\n");
+}
+
+int run_get(struct pmixer_priv *priv, const struct selector *selector, enum output_format format)
+{
+    struct get g = { format, { 0 }, -1 };
+    size_t written = 0;
+
+    check(submit_commands(priv, selector, NULL, 0, get_cb, &g) == 0, "Can't query volume.");
+    check(wait_ops(priv) == 0, "Lost connection to server.");
+    check(g.rc == 0 && !g.out.failed, "Can't query volume.");
+
+    /* One write, so a reader never sees half a report. */
+    while (written < g.out.len) {
+        ssize_t n = write(STDOUT_FILENO, g.out.data + written, g.out.len - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        check(n > 0, "Can't write output.");
+        written += n;
+    }
+
+    free(g.out.data);
+    return 0;
+
+error:
+    free(g.out.data);
+    return -1;
+}
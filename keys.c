@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+#define QUEUE_MAX 32
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+#define TEST_BIT(bits, bit) ((bits)[(bit) / BITS_PER_LONG] & (1UL << ((bit) % BITS_PER_LONG)))
+
+struct keys;
+
+struct press {
+    enum target_type type;
+    struct command command;
+};
+
+struct device {
+    struct keys *keys;
+    int fd;
+    char *path;
+    pa_io_event *event;
+    struct device *next;
+};
+
+struct keys {
+    struct pmixer_priv *priv;
+    struct device *devices;
+    size_t ndevices;
+    struct press queued[QUEUE_MAX];
+    size_t nqueued;
+    int quit;
+};
+
+static void device_free(struct keys *k, struct device *dev)
+{
+    if (dev->event)
+        k->priv->mainloop_api->io_free(dev->event);
+    close(dev->fd);
+    free(dev->path);
+    free(dev);
+}
+
+static void remove_device(struct keys *k, struct device *dev)
+{
+    for (struct device **p = &k->devices; *p; p = &(*p)->next) {
+        if (*p == dev) {
+            *p = dev->next;
+            break;
+        }
+    }
+    k->ndevices--;
+    device_free(k, dev);
+}
+
+static void done_cb(struct pmixer_priv *priv, int rc, const struct target *targets, size_t ntargets, void *raw)
+{
+    if (rc != 0)
+        log_warn("Key press failed%s.", rc == -ETIMEDOUT ? " (timeout)" : "");
+}
+
+static void press(struct keys *k, const struct input_event *ev)
+{
+    struct selector selector = { TARGET_SINK, NULL };
+    struct command command = { CMD_NOP, 0 };
+
+    /* Auto-repeat (value 2) keeps stepping the volume but never re-toggles mute. */
+    switch (ev->code) {
+        case KEY_VOLUMEUP:
+            if (ev->value == 1 || ev->value == 2)
+                command.cmd = CMD_INC;
+            break;
+        case KEY_VOLUMEDOWN:
+            if (ev->value == 1 || ev->value == 2)
+                command.cmd = CMD_DEC;
+            break;
+        case KEY_MUTE:
+            if (ev->value == 1)
+                command.cmd = CMD_MUTE;
+            break;
+        case KEY_MICMUTE:
+            if (ev->value == 1)
+                command.cmd = CMD_MUTE;
+            selector.type = TARGET_SOURCE;
+            break;
+    }
+    if (command.cmd == CMD_NOP)
+        return;
+
+    if (k->priv->state != CONNECTED) {
+        if (k->nqueued < QUEUE_MAX)
+            k->queued[k->nqueued++] = (struct press){ selector.type, command };
+        else
+            log_warn("Dropping key press while disconnected.");
+        return;
+    }
+    if (submit_commands(k->priv, &selector, &command, 1, done_cb, k) != 0)
+        log_warn("Can't submit key press.");
+}
+
+static void device_cb(pa_mainloop_api *api, pa_io_event *e, int fd, pa_io_event_flags_t events, void *raw)
+{
+    struct device *dev = raw;
+    struct keys *k = dev->keys;
+    struct input_event evs[64];
+    ssize_t n;
+
+    for (;;) {
+        n = read(fd, evs, sizeof(evs));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0) {
+            log_warn("Lost input device %s.", dev->path);
+            remove_device(k, dev);
+            if (k->ndevices == 0)
+                k->quit = 1;
+            return;
+        }
+        for (size_t i = 0; i < n / sizeof(struct input_event); i++) {
+            if (evs[i].type == EV_KEY)
+                press(k, &evs[i]);
+        }
+    }
+}
+
+static int has_volume_keys(int fd)
+{
+    unsigned long bits[KEY_MAX / BITS_PER_LONG + 1] = { 0 };
+
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits) < 0)
+        return 0;
+    return TEST_BIT(bits, KEY_VOLUMEUP) || TEST_BIT(bits, KEY_VOLUMEDOWN) ||
+           TEST_BIT(bits, KEY_MUTE) || TEST_BIT(bits, KEY_MICMUTE);
+}
+
+static int add_device(struct keys *k, const char *path, int explicit)
+{
+    pa_mainloop_api *api = k->priv->mainloop_api;
+    struct device *dev = NULL;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        if (explicit)
+            log_err("Can't open %s.", path);
+        return -1;
+    }
+    if (!has_volume_keys(fd)) {
+        if (explicit)
+            log_err("%s has no volume keys.", path);
+        close(fd);
+        return -1;
+    }
+
+    dev = calloc(1, sizeof(struct device));
+    check_mem(dev);
+    dev->keys = k;
+    dev->fd = fd;
+    check_mem(dev->path = strdup(path));
+    dev->event = api->io_new(api, fd, PA_IO_EVENT_INPUT, device_cb, dev);
+    check_mem(dev->event);
+
+    dev->next = k->devices;
+    k->devices = dev;
+    k->ndevices++;
+    log_info("Listening for keys on %s", path);
+    return 0;
+
+error:
+    if (dev) {
+        free(dev->path);
+        free(dev);
+    }
+    close(fd);
+    return -1;
+}
+
+/* Presses made while disconnected are folded into one write per device on reconnect. */
+static int session_up(struct pmixer_priv *priv, void *raw)
+{
+    struct keys *k = raw;
+    enum target_type types[] = { TARGET_SINK, TARGET_SOURCE };
+    struct command commands[QUEUE_MAX];
+
+    priv->cache = cache_new(priv);
+    if (!priv->cache)
+        return -1;
+    for (int t = 0; t < 2; t++) {
+        struct selector selector = { types[t], NULL };
+        size_t n = 0;
+
+        for (size_t i = 0; i < k->nqueued; i++) {
+            if (k->queued[i].type == types[t])
+                commands[n++] = k->queued[i].command;
+        }
+        if (n && submit_commands(priv, &selector, commands, n, done_cb, k) != 0)
+            log_warn("Can't submit queued key presses.");
+    }
+    k->nqueued = 0;
+    return 0;
+}
+
+static int session_down(struct pmixer_priv *priv, void *raw)
+{
+    if (priv->cache) {
+        cache_free(priv->cache);
+        priv->cache = NULL;
+    }
+    return 0;
+}
+
+static void quit_cb(pa_mainloop_api *api, pa_signal_event *e, int sig, void *raw)
+{
+    struct keys *k = raw;
+    k->quit = 1;
+}
+
+int run_keys(struct pmixer_priv *priv, const char *device)
+{
+    struct keys k = { .priv = priv };
+    struct reconnect *reconnect = NULL;
+    glob_t g = { 0 };
+    int retval;
+
+    check(pa_signal_init(priv->mainloop_api) == 0, "Can't set up signal handling.");
+    pa_signal_new(SIGINT, quit_cb, &k);
+    pa_signal_new(SIGTERM, quit_cb, &k);
+    pa_signal_new(SIGUSR1, trace_signal_cb, NULL);
+
+    priv->cache = cache_new(priv);
+    check(priv->cache, "Can't set up sink cache.");
+    check(wait_ops(priv) == 0, "Unable to populate sink cache.");
+
+    if (device) {
+        add_device(&k, device, 1);
+    } else if (glob("/dev/input/event*", 0, NULL, &g) == 0) {
+        for (size_t i = 0; i < g.gl_pathc; i++)
+            add_device(&k, g.gl_pathv[i], 0);
+    }
+    globfree(&g);
+    check(k.ndevices > 0, "No readable input device with volume keys (is the user in the input group?)");
+    reconnect = reconnect_new(priv, session_up, session_down, &k);
+    check(reconnect, "Can't set up reconnect.");
+
+    while (!k.quit) {
+        if (pa_mainloop_iterate(priv->mainloop, 1, &retval) < 0)
+            break;
+    }
+    check(k.ndevices > 0, "No input devices left.");
+
+    retval = 0;
+    goto out;
+
+error:
+    retval = -1;
+out:
+    if (reconnect)
+        reconnect_free(reconnect);
+    while (k.devices) {
+        struct device *dev = k.devices;
+        k.devices = dev->next;
+        device_free(&k, dev);
+    }
+    if (priv->cache) {
+        if (priv->state == CONNECTED)
+            wait_ops(priv);
+        cache_free(priv->cache);
+        priv->cache = NULL;
+    }
+    pa_signal_done();
+    return retval;
+}
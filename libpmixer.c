@@ -0,0 +1,231 @@
+#include <stdlib.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+#include "libpmixer.h"
+
+struct pmixer {
+    pa_threaded_mainloop *mainloop;
+    struct pmixer_priv priv;
+    enum pmixer_state state;
+    pmixer_state_cb state_cb;
+    void *userdata;
+    struct call *spare_calls;
+    struct pmixer_sink *sinks;
+    size_t sinks_alloc;
+};
+
+struct call {
+    struct pmixer *p;
+    pmixer_result_cb cb;
+    void *userdata;
+    struct call *next;
+};
+
+static void lock(struct pmixer *p)
+{
+    if (!pa_threaded_mainloop_in_thread(p->mainloop))
+        pa_threaded_mainloop_lock(p->mainloop);
+}
+
+static void unlock(struct pmixer *p)
+{
+    if (!pa_threaded_mainloop_in_thread(p->mainloop))
+        pa_threaded_mainloop_unlock(p->mainloop);
+}
+
+static void state_changed(struct pmixer_priv *priv, void *raw)
+{
+    struct pmixer *p = raw;
+    enum pmixer_state state = PMIXER_CONNECTING;
+
+    switch (priv->state) {
+        case CONNECTED:
+            if (!priv->cache)
+                priv->cache = cache_new(priv);
+            state = PMIXER_READY;
+            break;
+        case ERROR:
+        case TIMEOUT:
+            state = PMIXER_FAILED;
+            break;
+        case CONNECTING:
+            break;
+    }
+    if (state == p->state)
+        return;
+    p->state = state;
+    if (p->state_cb)
+        p->state_cb(p, state, p->userdata);
+}
+
+static void put_call(struct pmixer *p, struct call *call)
+{
+    call->next = p->spare_calls;
+    p->spare_calls = call;
+}
+
+/* The sink array is borrowed for the callback, so a request submitted
+ * and finished from inside it gets its own. */
+static void result_cb(struct pmixer_priv *priv, int rc, const struct target *targets, size_t ntargets, void *raw)
+{
+    struct call *call = raw;
+    struct pmixer *p = call->p;
+    struct pmixer_sink *sinks = p->sinks;
+    size_t alloc = p->sinks_alloc;
+
+    p->sinks = NULL;
+    p->sinks_alloc = 0;
+    if (ntargets > alloc) {
+        struct pmixer_sink *grown = realloc(sinks, ntargets * sizeof(struct pmixer_sink));
+        if (grown) {
+            sinks = grown;
+            alloc = ntargets;
+        } else {
+            rc = -1;
+            ntargets = 0;
+        }
+    }
+    for (size_t i = 0; i < ntargets; i++) {
+        sinks[i].name = targets[i].after.name;
+        sinks[i].index = targets[i].after.index;
+        sinks[i].volume = volume_percent(&targets[i].after.volume);
+        sinks[i].mute = targets[i].after.mute;
+    }
+    if (call->cb)
+        call->cb(p, rc, sinks, ntargets, call->userdata);
+    put_call(p, call);
+    free(p->sinks);
+    p->sinks = sinks;
+    p->sinks_alloc = alloc;
+}
+
+static int submit(struct pmixer *p, const char *sink, enum commands cmd, unsigned percent,
+                  pmixer_result_cb cb, void *userdata)
+{
+    struct selector selector = { TARGET_SINK, sink };
+    struct command command = { cmd, percent };
+    struct call *call = NULL;
+    int rc = -1;
+
+    lock(p);
+    check(p->priv.state == CONNECTED, "Not connected to server.");
+    call = p->spare_calls;
+    if (call)
+        p->spare_calls = call->next;
+    else
+        check_mem(call = calloc(1, sizeof(struct call)));
+    call->p = p;
+    call->cb = cb;
+    call->userdata = userdata;
+
+    check(submit_commands(&p->priv, &selector, &command, cmd == CMD_NOP ? 0 : 1,
+                          result_cb, call) == 0, "Can't send request.");
+    call = NULL;
+    rc = 0;
+
+error:
+    if (call)
+        put_call(p, call);
+    unlock(p);
+    return rc;
+}
+
+struct pmixer *pmixer_new(const char *server, pmixer_state_cb cb, void *userdata)
+{
+    struct pmixer *p = calloc(1, sizeof(struct pmixer));
+
+    check_mem(p);
+    p->state = PMIXER_CONNECTING;
+    p->state_cb = cb;
+    p->userdata = userdata;
+    p->priv.op_timeout_ms = PMIXER_DEFAULT_TIMEOUT_MS;
+
+    check_mem(p->mainloop = pa_threaded_mainloop_new());
+    p->priv.mainloop_api = pa_threaded_mainloop_get_api(p->mainloop);
+    check(new_context(&p->priv, "libpmixer") == 0, "Can't create context.");
+    p->priv.state_notify = state_changed;
+    p->priv.state_notify_raw = p;
+
+    check(pa_context_connect(p->priv.context, server, PA_CONTEXT_NOFLAGS, NULL) >= 0,
+          "Can't connect: %s", pa_strerror(pa_context_errno(p->priv.context)));
+    check(pa_threaded_mainloop_start(p->mainloop) >= 0, "Can't start mainloop thread.");
+    return p;
+
+error:
+    pmixer_free(p);
+    return NULL;
+}
+
+void pmixer_free(struct pmixer *p)
+{
+    if (!p)
+        return;
+
+    if (p->mainloop) {
+        pa_threaded_mainloop_lock(p->mainloop);
+        if (p->priv.context) {
+            p->priv.state_notify = NULL;
+            pa_context_disconnect(p->priv.context);
+        }
+        if (p->priv.cache) {
+            cache_free(p->priv.cache);
+            p->priv.cache = NULL;
+        }
+        if (p->priv.context) {
+            pa_context_unref(p->priv.context);
+            p->priv.context = NULL;
+        }
+        free_request_pool(&p->priv);
+        free_op_pool(&p->priv);
+        pa_threaded_mainloop_unlock(p->mainloop);
+        pa_threaded_mainloop_stop(p->mainloop);
+        pa_threaded_mainloop_free(p->mainloop);
+    }
+    while (p->spare_calls) {
+        struct call *call = p->spare_calls;
+        p->spare_calls = call->next;
+        free(call);
+    }
+    free(p->sinks);
+    free(p);
+}
+
+void pmixer_set_timeout(struct pmixer *p, unsigned timeout_ms)
+{
+    lock(p);
+    p->priv.op_timeout_ms = timeout_ms;
+    unlock(p);
+}
+
+int pmixer_get(struct pmixer *p, const char *sink, pmixer_result_cb cb, void *userdata)
+{
+    return submit(p, sink, CMD_NOP, 0, cb, userdata);
+}
+
+int pmixer_inc(struct pmixer *p, const char *sink, pmixer_result_cb cb, void *userdata)
+{
+    return submit(p, sink, CMD_INC, 0, cb, userdata);
+}
+
+int pmixer_dec(struct pmixer *p, const char *sink, pmixer_result_cb cb, void *userdata)
+{
+    return submit(p, sink, CMD_DEC, 0, cb, userdata);
+}
+
+int pmixer_mute(struct pmixer *p, const char *sink, pmixer_result_cb cb, void *userdata)
+{
+    return submit(p, sink, CMD_MUTE, 0, cb, userdata);
+}
+
+int pmixer_set(struct pmixer *p, const char *sink, unsigned percent, pmixer_result_cb cb, void *userdata)
+{
+    if (percent > SET_PERCENT_MAX)
+        percent = SET_PERCENT_MAX;
+    return submit(p, sink, CMD_SET, percent, cb, userdata);
+}
+
+int pmixer_set_mute(struct pmixer *p, const char *sink, int mute, pmixer_result_cb cb, void *userdata)
+{
+    return submit(p, sink, mute ? CMD_MUTE_ON : CMD_MUTE_OFF, 0, cb, userdata);
+}
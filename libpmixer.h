@@ -0,0 +1,71 @@
+#ifndef __libpmixer_h__
+#define __libpmixer_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PMIXER_API __attribute__((visibility("default")))
+
+#define PMIXER_DEFAULT_TIMEOUT_MS 2000
+
+struct pmixer;
+
+enum pmixer_state {
+    PMIXER_CONNECTING,
+    PMIXER_READY,
+    PMIXER_FAILED,
+};
+
+/* name is only valid for the duration of the callback. */
+struct pmixer_sink {
+    const char *name;
+    uint32_t index;
+    unsigned volume;
+    int mute;
+};
+
+/*
+ * Callbacks run on the mainloop thread with the mainloop locked, or on the
+ * calling thread when a request can be answered straight from the cache.
+ * They may issue further requests but must not call pmixer_free().
+ *
+ * Each instance has its own mainloop thread, so several can run at once;
+ * the trace and metrics they record are shared by the whole process.
+ *
+ * rc is 0 on success, -ETIMEDOUT if the server did not answer in time and
+ * -1 on any other failure. sinks holds the state of every matched sink
+ * after the command was applied.
+ */
+typedef void (*pmixer_state_cb)(struct pmixer *p, enum pmixer_state state, void *userdata);
+typedef void (*pmixer_result_cb)(struct pmixer *p, int rc, const struct pmixer_sink *sinks,
+                                 size_t nsinks, void *userdata);
+
+/* Starts connecting to server (NULL for the default) in the background. */
+PMIXER_API struct pmixer *pmixer_new(const char *server, pmixer_state_cb cb, void *userdata);
+/* Disconnects; outstanding requests complete with an error first. */
+PMIXER_API void pmixer_free(struct pmixer *p);
+PMIXER_API void pmixer_set_timeout(struct pmixer *p, unsigned timeout_ms);
+
+/*
+ * sink is a glob matched against sink names, or NULL for the default sink.
+ * These return -1 without calling cb if the request could not be sent.
+ */
+PMIXER_API int pmixer_get(struct pmixer *p, const char *sink, pmixer_result_cb cb, void *userdata);
+PMIXER_API int pmixer_inc(struct pmixer *p, const char *sink, pmixer_result_cb cb, void *userdata);
+PMIXER_API int pmixer_dec(struct pmixer *p, const char *sink, pmixer_result_cb cb, void *userdata);
+PMIXER_API int pmixer_mute(struct pmixer *p, const char *sink, pmixer_result_cb cb, void *userdata);
+/* Absolute changes; on the default sink these are sent without a read. */
+PMIXER_API int pmixer_set(struct pmixer *p, const char *sink, unsigned percent,
+                          pmixer_result_cb cb, void *userdata);
+PMIXER_API int pmixer_set_mute(struct pmixer *p, const char *sink, int mute,
+                               pmixer_result_cb cb, void *userdata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <signal.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+struct loop_io {
+    pa_mainloop_api *api;
+    pa_io_event *event;
+    loop_io_cb_t cb;
+    void *raw;
+};
+
+struct loop_timer {
+    pa_mainloop_api *api;
+    pa_time_event *event;
+    loop_timer_cb_t cb;
+    void *raw;
+};
+
+/* Signals are process-wide, so their handlers are too. */
+static struct {
+    loop_signal_cb_t cb;
+    void *raw;
+} handlers[NSIG];
+
+static pa_io_event_flags_t io_flags(int events)
+{
+    return (events & LOOP_IN ? PA_IO_EVENT_INPUT : 0) | (events & LOOP_OUT ? PA_IO_EVENT_OUTPUT : 0);
+}
+
+static void io_cb(pa_mainloop_api *api, pa_io_event *e, int fd, pa_io_event_flags_t events, void *raw)
+{
+    struct loop_io *io = raw;
+    io->cb(io, fd, io->raw);
+}
+
+struct loop_io *loop_io_new(struct pmixer_priv *priv, int fd, int events, loop_io_cb_t cb, void *raw)
+{
+    struct loop_io *io = calloc(1, sizeof(struct loop_io));
+
+    check_mem(io);
+    io->api = priv->mainloop_api;
+    io->cb = cb;
+    io->raw = raw;
+    io->event = io->api->io_new(io->api, fd, io_flags(events), io_cb, io);
+    check_mem(io->event);
+    return io;
+
+error:
+    free(io);
+    return NULL;
+}
+
+void loop_io_enable(struct loop_io *io, int events)
+{
+    io->api->io_enable(io->event, io_flags(events));
+}
+
+void loop_io_free(struct loop_io *io)
+{
+    io->api->io_free(io->event);
+    free(io);
+}
+
+static void timer_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *raw)
+{
+    struct loop_timer *timer = raw;
+    timer->cb(timer, timer->raw);
+}
+
+struct loop_timer *loop_timer_new(struct pmixer_priv *priv, loop_timer_cb_t cb, void *raw)
+{
+    struct loop_timer *timer = calloc(1, sizeof(struct loop_timer));
+
+    check_mem(timer);
+    timer->api = priv->mainloop_api;
+    timer->cb = cb;
+    timer->raw = raw;
+    timer->event = timer->api->time_new(timer->api, NULL, timer_cb, timer);
+    check_mem(timer->event);
+    return timer;
+
+error:
+    free(timer);
+    return NULL;
+}
+
+void loop_timer_arm(struct loop_timer *timer, unsigned ms)
+{
+    struct timeval tv;
+
+    pa_timeval_add(pa_gettimeofday(&tv), (pa_usec_t)ms * PA_USEC_PER_MSEC);
+    timer->api->time_restart(timer->event, &tv);
+}
+
+void loop_timer_free(struct loop_timer *timer)
+{
+    timer->api->time_free(timer->event);
+    free(timer);
+}
+
+static void signal_cb(pa_mainloop_api *api, pa_signal_event *e, int sig, void *raw)
+{
+    handlers[sig].cb(sig, handlers[sig].raw);
+}
+
+int loop_signals_init(struct pmixer_priv *priv)
+{
+    return pa_signal_init(priv->mainloop_api);
+}
+
+int loop_signal(struct pmixer_priv *priv, int sig, loop_signal_cb_t cb, void *raw)
+{
+    handlers[sig].cb = cb;
+    handlers[sig].raw = raw;
+    return pa_signal_new(sig, signal_cb, NULL) ? 0 : -1;
+}
+
+void loop_signals_done(struct pmixer_priv *priv)
+{
+    pa_signal_done();
+}
+
+int loop_iterate(struct pmixer_priv *priv)
+{
+    int retval;
+
+    return pa_mainloop_iterate(priv->mainloop, 1, &retval) < 0 ? -1 : 0;
+}
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <math.h>
+#include <signal.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+struct meter {
+    pa_stream *stream;
+    unsigned rate;
+    int failed;
+    int quit;
+};
+
+/* Eight independent accumulators keep the loop free of a serial
+ * dependency so the compiler can vectorise it. */
+float peak_float(const float *restrict samples, size_t n)
+{
+    float acc[8] = { 0 };
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        for (int j = 0; j < 8; j++) {
+            float v = fabsf(samples[i + j]);
+            acc[j] = v > acc[j] ? v : acc[j];
+        }
+    }
+    for (; i < n; i++) {
+        float v = fabsf(samples[i]);
+        acc[0] = v > acc[0] ? v : acc[0];
+    }
+    for (int j = 1; j < 8; j++)
+        acc[0] = acc[j] > acc[0] ? acc[j] : acc[0];
+    return acc[0];
+}
+
+static void read_cb(pa_stream *s, size_t nbytes, void *raw)
+{
+    const void *data;
+    float peak;
+
+    while (pa_stream_peek(s, &data, &nbytes) == 0 && nbytes > 0) {
+        if (data) {
+            peak = peak_float(data, nbytes / sizeof(float));
+            printf("%u\n", (unsigned)lrintf((peak > 1.0f ? 1.0f : peak) * 100.0f));
+        }
+        pa_stream_drop(s);
+    }
+}
+
+static void stream_state_cb(pa_stream *s, void *raw)
+{
+    struct meter *m = raw;
+
+    switch (pa_stream_get_state(s)) {
+        case PA_STREAM_FAILED:
+            log_err("Monitor stream failed: %s", pa_strerror(pa_context_errno(pa_stream_get_context(s))));
+            m->failed = 1;
+            break;
+        case PA_STREAM_TERMINATED:
+            m->quit = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+static void quit_cb(pa_mainloop_api *api, pa_signal_event *e, int sig, void *raw)
+{
+    struct meter *m = raw;
+    m->quit = 1;
+}
+
+static void stop_stream(struct meter *m)
+{
+    if (!m->stream)
+        return;
+    pa_stream_set_state_callback(m->stream, NULL, NULL);
+    pa_stream_set_read_callback(m->stream, NULL, NULL);
+    if (pa_stream_get_state(m->stream) == PA_STREAM_READY)
+        pa_stream_disconnect(m->stream);
+    pa_stream_unref(m->stream);
+    m->stream = NULL;
+}
+
+static int start_stream(struct pmixer_priv *priv, void *raw)
+{
+    struct meter *m = raw;
+    pa_sample_spec spec = { .format = PA_SAMPLE_FLOAT32NE, .rate = m->rate, .channels = 1 };
+    pa_buffer_attr attr = {
+        .maxlength = (uint32_t)-1,
+        .fragsize = sizeof(float),
+    };
+
+    m->stream = pa_stream_new(priv->context, "pmixer meter", &spec, NULL);
+    check(m->stream, "Can't create monitor stream: %s", pa_strerror(pa_context_errno(priv->context)));
+    pa_stream_set_state_callback(m->stream, stream_state_cb, m);
+    pa_stream_set_read_callback(m->stream, read_cb, m);
+
+    check(pa_stream_connect_record(m->stream, "@DEFAULT_MONITOR@", &attr,
+                                   PA_STREAM_PEAK_DETECT | PA_STREAM_ADJUST_LATENCY |
+                                   PA_STREAM_DONT_MOVE | PA_STREAM_DONT_INHIBIT_AUTO_SUSPEND) == 0,
+          "Can't record from the default monitor: %s", pa_strerror(pa_context_errno(priv->context)));
+    return 0;
+
+error:
+    stop_stream(m);
+    return -1;
+}
+
+static int drop_stream(struct pmixer_priv *priv, void *raw)
+{
+    stop_stream(raw);
+    return 0;
+}
+
+int run_meter(struct pmixer_priv *priv, unsigned rate)
+{
+    struct meter m = { .rate = rate };
+    struct reconnect *reconnect = NULL;
+    int retval;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    check(pa_signal_init(priv->mainloop_api) == 0, "Can't set up signal handling.");
+    pa_signal_new(SIGINT, quit_cb, &m);
+    pa_signal_new(SIGTERM, quit_cb, &m);
+    pa_signal_new(SIGUSR1, trace_signal_cb, NULL);
+
+    check(start_stream(priv, &m) == 0, "Can't start meter.");
+    reconnect = reconnect_new(priv, start_stream, drop_stream, &m);
+    check(reconnect, "Can't set up reconnect.");
+
+    while (!m.quit && !m.failed) {
+        if (pa_mainloop_iterate(priv->mainloop, 1, &retval) < 0)
+            break;
+    }
+    check(!m.failed, "Meter stopped.");
+
+    retval = 0;
+    goto out;
+
+error:
+    retval = -1;
+out:
+    if (reconnect)
+        reconnect_free(reconnect);
+    stop_stream(&m);
+    pa_signal_done();
+    return retval;
+}
@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+#define OPS_MAX 16
+#define TARGETS 3
+
+/* Upper bounds in microseconds; the last bucket is +Inf. */
+static const uint64_t bounds[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+};
+#define BUCKETS (sizeof(bounds) / sizeof(bounds[0]) + 1)
+
+/* Shared by every library instance in the process, each possibly on its
+ * own mainloop thread, so everything here is updated atomically. */
+struct op_histogram {
+    _Atomic(const char *) name;
+    _Atomic uint64_t buckets[BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_usec;
+};
+
+static struct {
+    _Atomic uint64_t commands[TARGETS][CMD_SET + 1];
+    _Atomic uint64_t invalid;
+    _Atomic uint64_t rejected;
+    _Atomic uint64_t flushes;
+    _Atomic uint64_t coalesced;
+    _Atomic uint64_t cache_hits;
+    _Atomic uint64_t cache_misses;
+    _Atomic uint64_t reconnects;
+    _Atomic uint64_t disconnects;
+    _Atomic unsigned inflight;
+    _Atomic unsigned inflight_max;
+    struct op_histogram ops[OPS_MAX];
+    _Atomic uint64_t ops_dropped;
+} m;
+
+void metrics_command(enum target_type type, enum commands cmd)
+{
+    m.commands[type][cmd]++;
+}
+
+void metrics_invalid(void)
+{
+    m.invalid++;
+}
+
+void metrics_rejected(void)
+{
+    m.rejected++;
+}
+
+void metrics_flush(size_t count)
+{
+    m.flushes++;
+    m.coalesced += count;
+}
+
+void metrics_cache(int hit)
+{
+    if (hit)
+        m.cache_hits++;
+    else
+        m.cache_misses++;
+}
+
+void metrics_reconnect(void)
+{
+    m.reconnects++;
+}
+
+void metrics_disconnect(void)
+{
+    m.disconnects++;
+}
+
+void metrics_inflight(unsigned depth)
+{
+    unsigned max = m.inflight_max;
+
+    m.inflight = depth;
+    while (depth > max && !atomic_compare_exchange_weak(&m.inflight_max, &max, depth))
+        ;
+}
+
+/* Op names are string literals, so the pointer compare almost always hits.
+ * Free slots are claimed with a compare and swap, so two threads adding the
+ * same op at once still share one histogram. */
+static struct op_histogram *find_op(const char *name)
+{
+    for (size_t i = 0; i < OPS_MAX; i++) {
+        const char *seen = m.ops[i].name;
+
+        if (!seen && atomic_compare_exchange_strong(&m.ops[i].name, &seen, name))
+            return &m.ops[i];
+        if (seen == name || strcmp(seen, name) == 0)
+            return &m.ops[i];
+    }
+    return NULL;
+}
+
+void metrics_op(const char *name, uint64_t usec)
+{
+    struct op_histogram *h = find_op(name);
+    size_t b = 0;
+
+    if (!h) {
+        m.ops_dropped++;
+        return;
+    }
+    while (b < BUCKETS - 1 && usec > bounds[b])
+        b++;
+    h->buckets[b]++;
+    h->count++;
+    h->sum_usec += usec;
+}
+
+static void counter(FILE *f, const char *name, const char *help, uint64_t value)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long)value);
+}
+
+void metrics_dump(FILE *f)
+{
+    static const enum target_type types[] = { TARGET_SINK, TARGET_SOURCE, TARGET_SINK_INPUT };
+
+    fprintf(f, "# HELP pmixer_commands_total Commands received, by target and verb.\n");
+    fprintf(f, "# TYPE pmixer_commands_total counter\n");
+    for (size_t t = 0; t < TARGETS; t++) {
+        for (int i = 0; cmd_map[i].cmd != 0; i++) {
+            enum commands cmd = cmd_map[i].cmd;
+            uint64_t n = m.commands[types[t]][cmd];
+
+            if (cmd == CMD_MUTE)
+                n += m.commands[types[t]][CMD_MUTE_ON] + m.commands[types[t]][CMD_MUTE_OFF];
+            fprintf(f, "pmixer_commands_total{target=\"%s\",verb=\"%s\"} %llu\n",
+                    target_name(types[t]), cmd_map[i].text, (unsigned long long)n);
+        }
+    }
+    counter(f, "pmixer_invalid_commands_total", "Requests that did not parse.", m.invalid);
+    counter(f, "pmixer_rejected_commands_total", "Commands refused while disconnected.", m.rejected);
+    counter(f, "pmixer_flushes_total", "Coalesced batches sent to the server.", m.flushes);
+    counter(f, "pmixer_flushed_commands_total", "Commands sent in those batches.", m.coalesced);
+    counter(f, "pmixer_cache_hits_total", "Default device lookups answered from the cache.", m.cache_hits);
+    counter(f, "pmixer_cache_misses_total", "Default device lookups that went to the server.", m.cache_misses);
+    counter(f, "pmixer_disconnects_total", "Connections to the server lost.", m.disconnects);
+    counter(f, "pmixer_reconnects_total", "Connections to the server re-established.", m.reconnects);
+    counter(f, "pmixer_server_ops_dropped_total", "Server requests not in any histogram.", m.ops_dropped);
+
+    fprintf(f, "# HELP pmixer_inflight_ops Server requests awaiting an answer.\n");
+    fprintf(f, "# TYPE pmixer_inflight_ops gauge\npmixer_inflight_ops %u\n", m.inflight);
+    fprintf(f, "# HELP pmixer_inflight_ops_max Most server requests awaiting an answer at once.\n");
+    fprintf(f, "# TYPE pmixer_inflight_ops_max gauge\npmixer_inflight_ops_max %u\n", m.inflight_max);
+
+    fprintf(f, "# HELP pmixer_server_op_seconds Server round trip, by request.\n");
+    fprintf(f, "# TYPE pmixer_server_op_seconds histogram\n");
+    for (size_t i = 0; i < OPS_MAX && m.ops[i].name; i++) {
+        struct op_histogram *h = &m.ops[i];
+        uint64_t cumulative = 0;
+
+        for (size_t b = 0; b < BUCKETS; b++) {
+            cumulative += h->buckets[b];
+            if (b < BUCKETS - 1)
+                fprintf(f, "pmixer_server_op_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+                        h->name, bounds[b] / 1e6, (unsigned long long)cumulative);
+            else
+                fprintf(f, "pmixer_server_op_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+                        h->name, (unsigned long long)cumulative);
+        }
+        fprintf(f, "pmixer_server_op_seconds_sum{op=\"%s\"} %.6f\n", h->name, h->sum_usec / 1e6);
+        fprintf(f, "pmixer_server_op_seconds_count{op=\"%s\"} %llu\n", h->name, (unsigned long long)h->count);
+    }
+    fflush(f);
+}
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+struct tracked_op {
+    struct pmixer_priv *priv;
+    pa_operation *op;
+    const char *name;
+    uint64_t started;
+    op_done_cb_t cb;
+    void *raw;
+    pa_time_event *deadline;
+    int expired;
+    struct tracked_op *prev;
+    struct tracked_op *next;
+};
+
+/* Finished ops go back on a per-connection free list with their deadline
+ * timer disabled, so steady-state traffic allocates nothing here. */
+static struct tracked_op *get_op(struct pmixer_priv *priv)
+{
+    struct tracked_op *t = priv->spare_ops;
+    pa_time_event *deadline = NULL;
+
+    if (!t)
+        return calloc(1, sizeof(struct tracked_op));
+
+    priv->spare_ops = t->next;
+    deadline = t->deadline;
+    memset(t, 0, sizeof(struct tracked_op));
+    t->deadline = deadline;
+    return t;
+}
+
+static void put_op(struct pmixer_priv *priv, struct tracked_op *t)
+{
+    if (t->deadline)
+        priv->mainloop_api->time_restart(t->deadline, NULL);
+    t->next = priv->spare_ops;
+    priv->spare_ops = t;
+}
+
+void free_op_pool(struct pmixer_priv *priv)
+{
+    while (priv->spare_ops) {
+        struct tracked_op *t = priv->spare_ops;
+        priv->spare_ops = t->next;
+        if (t->deadline)
+            priv->mainloop_api->time_free(t->deadline);
+        free(t);
+    }
+}
+
+static void op_state_cb(pa_operation *op, void *raw)
+{
+    struct tracked_op *t = raw;
+    struct pmixer_priv *priv = t->priv;
+    pa_operation_state_t op_state = pa_operation_get_state(op);
+    uint64_t now;
+
+    if (op_state == PA_OPERATION_RUNNING)
+        return;
+
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        priv->ops = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    priv->inflight--;
+    metrics_inflight(priv->inflight);
+
+    now = now_usec();
+    if (timings_enabled)
+        timing_record(t->name, t->started, now);
+    trace_record(t->name, t->started, now,
+                 t->expired ? -ETIMEDOUT : op_state == PA_OPERATION_CANCELLED ? -ECANCELED : 0);
+    metrics_op(t->name, now - t->started);
+
+    pa_operation_set_state_callback(op, NULL, NULL);
+    if (t->cb) {
+        if (t->expired)
+            t->cb(priv, OP_TIMEOUT, t->raw);
+        else
+            t->cb(priv, op_state == PA_OPERATION_CANCELLED ? OP_CANCELLED : OP_DONE, t->raw);
+    }
+    pa_operation_unref(op);
+    put_op(priv, t);
+}
+
+static void deadline_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *raw)
+{
+    struct tracked_op *t = raw;
+
+    log_warn("%s timed out after %ums.", t->name, t->priv->op_timeout_ms);
+    t->priv->timed_out = 1;
+    t->expired = 1;
+    pa_operation_cancel(t->op);
+}
+
+int track_op(struct pmixer_priv *priv, pa_operation *op, const char *name, op_done_cb_t cb, void *raw)
+{
+    struct tracked_op *t = NULL;
+
+    check(op, "%s failed: %s", name, pa_strerror(pa_context_errno(priv->context)));
+    t = get_op(priv);
+    check_mem(t);
+
+    t->priv = priv;
+    t->op = op;
+    t->name = name;
+    t->started = now_usec();
+    t->cb = cb;
+    t->raw = raw;
+    t->next = priv->ops;
+    if (priv->ops)
+        priv->ops->prev = t;
+    priv->ops = t;
+    priv->inflight++;
+    metrics_inflight(priv->inflight);
+
+    if (priv->op_timeout_ms) {
+        struct timeval tv;
+        pa_timeval_add(pa_gettimeofday(&tv), priv->op_timeout_ms * PA_USEC_PER_MSEC);
+        if (t->deadline)
+            priv->mainloop_api->time_restart(t->deadline, &tv);
+        else
+            t->deadline = priv->mainloop_api->time_new(priv->mainloop_api, &tv, deadline_cb, t);
+    }
+
+    pa_operation_set_state_callback(op, op_state_cb, t);
+    if (pa_operation_get_state(op) != PA_OPERATION_RUNNING)
+        op_state_cb(op, t);
+    return 0;
+
+error:
+    if (op) {
+        pa_operation_cancel(op);
+        pa_operation_unref(op);
+    }
+    return -1;
+}
+
+/* Cancelling runs each op's done callback before it returns. */
+void cancel_ops(struct pmixer_priv *priv, void *raw)
+{
+    struct tracked_op *next;
+
+    for (struct tracked_op *t = priv->ops; t; t = next) {
+        next = t->next;
+        if (t->raw == raw)
+            pa_operation_cancel(t->op);
+    }
+}
+
+int wait_ops(struct pmixer_priv *priv)
+{
+    int retval;
+
+    while (priv->inflight > 0) {
+        if (pa_mainloop_iterate(priv->mainloop, 1, &retval) < 0)
+            return -1;
+    }
+    return priv->state == CONNECTED ? 0 : -1;
+}
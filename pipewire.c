@@ -0,0 +1,1191 @@
+#include <stdlib.h>
+#include <math.h>
+#include <fnmatch.h>
+
+#include <pipewire/pipewire.h>
+#include <pipewire/extensions/metadata.h>
+#include <spa/param/props.h>
+#include <spa/param/route.h>
+#include <spa/param/audio/raw.h>
+#include <spa/pod/builder.h>
+#include <spa/pod/iter.h>
+#include <spa/pod/parser.h>
+#include <spa/utils/json.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+/* Volumes are handled on PulseAudio's cubic scale so steps match the
+ * libpulse backend; PipeWire itself stores linear channel volumes. */
+
+#define ROUTE_MAX 8
+#define SIGNAL_MAX 4
+
+struct node {
+    uint32_t id;
+    enum target_type type;
+    char name[SINK_NAME_MAX];
+    char app[SINK_NAME_MAX];
+    char binary[SINK_NAME_MAX];
+    uint32_t device_id;
+    int32_t card_device;
+    struct pw_proxy *proxy;
+    struct spa_hook listener;
+    uint32_t channels;
+    float volumes[SPA_AUDIO_MAX_CHANNELS];
+    bool mute;
+    unsigned holds;
+    int stale;
+    struct node *next;
+};
+
+/* Cards keep the volume of each active port in its Route param. */
+struct device {
+    uint32_t id;
+    struct pw_proxy *proxy;
+    struct spa_hook listener;
+    struct {
+        int32_t index;
+        int32_t device;
+    } routes[ROUTE_MAX];
+    uint32_t nroutes;
+    struct device *next;
+};
+
+struct level {
+    uint32_t channels;
+    double volumes[SPA_AUDIO_MAX_CHANNELS];
+    int mute;
+};
+
+struct request {
+    struct pmixer_priv *priv;
+    enum target_type type;
+    int seq;
+    int writing;
+    int failed;
+    uint64_t started;
+    struct spa_source *timer;
+    uint32_t *ids;
+    size_t nids;
+    size_t nheld;
+    struct command *commands;
+    size_t count;
+    request_cb_t cb;
+    void *raw;
+    struct request *next;
+};
+
+struct loop_signal {
+    struct spa_source *source;
+    loop_signal_cb_t cb;
+    void *raw;
+};
+
+struct pw_backend {
+    struct pw_main_loop *loop;
+    struct pw_context *context;
+    struct pw_core *core;
+    struct spa_hook core_listener;
+    struct pw_registry *registry;
+    struct spa_hook registry_listener;
+    struct pw_proxy *metadata;
+    struct spa_hook metadata_listener;
+    struct spa_source *timer;
+    struct loop_signal signals[SIGNAL_MAX];
+    size_t nsignals;
+    struct node *nodes;
+    struct device *devices;
+    struct request *requests;
+    char default_sink[SINK_NAME_MAX];
+    char default_source[SINK_NAME_MAX];
+    char error[128];
+    int connect_seq;
+    int connect_phase;
+    int tracking;
+};
+
+static int unsupported(const char *what)
+{
+    log_err("%s is not available with the PipeWire backend.", what);
+    return -1;
+}
+
+static struct pw_loop *get_loop(struct pmixer_priv *priv)
+{
+    return pw_main_loop_get_loop(priv->pw->loop);
+}
+
+static void arm_timer(struct pw_loop *loop, struct spa_source *timer, unsigned ms)
+{
+    struct timespec value = { ms / 1000, (ms % 1000) * 1000000L };
+
+    /* A zero value disarms. */
+    pw_loop_update_timer(loop, timer, &value, NULL, false);
+}
+
+static void notify(struct pmixer_priv *priv)
+{
+    if (priv->state_notify)
+        priv->state_notify(priv, priv->state_notify_raw);
+}
+
+static void copy_prop(char *dst, size_t size, const struct spa_dict *props, const char *key)
+{
+    const char *value = spa_dict_lookup(props, key);
+
+    snprintf(dst, size, "%s", value ? value : "");
+}
+
+static struct node *find_node(const struct pw_backend *b, uint32_t id)
+{
+    for (struct node *n = b->nodes; n; n = n->next) {
+        if (n->id == id)
+            return n;
+    }
+    return NULL;
+}
+
+static struct device *find_device(const struct pw_backend *b, uint32_t id)
+{
+    for (struct device *dev = b->devices; dev; dev = dev->next) {
+        if (dev->id == id)
+            return dev;
+    }
+    return NULL;
+}
+
+static void free_node(struct node *n)
+{
+    if (n->proxy) {
+        spa_hook_remove(&n->listener);
+        pw_proxy_destroy(n->proxy);
+    }
+    free(n);
+}
+
+static void free_device(struct device *dev)
+{
+    if (dev->proxy) {
+        spa_hook_remove(&dev->listener);
+        pw_proxy_destroy(dev->proxy);
+    }
+    free(dev);
+}
+
+static void free_request(struct request *r)
+{
+    if (r->timer)
+        pw_loop_destroy_source(get_loop(r->priv), r->timer);
+    free(r->ids);
+    free(r->commands);
+    free(r);
+}
+
+/* Once a write is answered, a value that came in while it was on its way
+ * may be stale, so read the node again. */
+static void release_node(struct node *n, int failed)
+{
+    if (!n)
+        return;
+    if (failed)
+        n->stale = 1;
+    if (--n->holds == 0 && n->stale && n->proxy) {
+        n->stale = 0;
+        pw_node_enum_params((struct pw_node *)n->proxy, 0, SPA_PARAM_Props, 0, UINT32_MAX, NULL);
+    }
+}
+
+static const char *request_names[] = { "sink request", "source request", "stream request" };
+
+static void finish_request(struct request *r, int rc)
+{
+    struct pmixer_priv *priv = r->priv;
+    struct pw_backend *b = priv->pw;
+    struct request **p;
+
+    for (p = &b->requests; *p != r; p = &(*p)->next)
+        ;
+    *p = r->next;
+    for (size_t i = 0; i < r->nheld; i++)
+        release_node(find_node(b, r->ids[i]), rc != 0);
+
+    priv->inflight--;
+    metrics_inflight(priv->inflight);
+    trace_record(request_names[r->type], r->started, now_usec(), rc);
+    if (r->cb)
+        r->cb(priv, rc, NULL, 0, r->raw);
+    free_request(r);
+}
+
+static void sync_request(struct request *r)
+{
+    r->seq = pw_core_sync(r->priv->pw->core, PW_ID_CORE, 0);
+}
+
+static void write_request(struct request *r);
+
+static void core_done(void *data, uint32_t id, int seq)
+{
+    struct pmixer_priv *priv = data;
+    struct pw_backend *b = priv->pw;
+    struct request *r;
+
+    if (id != PW_ID_CORE)
+        return;
+
+    /* The first sync lists the globals, the second reads the default metadata. */
+    if (priv->state == CONNECTING && seq == b->connect_seq) {
+        if (++b->connect_phase < 2) {
+            b->connect_seq = pw_core_sync(b->core, PW_ID_CORE, 0);
+            return;
+        }
+        priv->state = CONNECTED;
+        notify(priv);
+        return;
+    }
+
+    for (r = b->requests; r && r->seq != seq; r = r->next)
+        ;
+    if (!r)
+        return;
+    if (!r->writing)
+        write_request(r);
+    else
+        finish_request(r, r->failed ? -1 : 0);
+}
+
+static int uses_proxy(const struct pw_backend *b, const struct request *r, uint32_t id)
+{
+    for (size_t i = 0; i < r->nheld; i++) {
+        const struct node *n = find_node(b, r->ids[i]);
+        const struct device *dev = n ? find_device(b, n->device_id) : NULL;
+
+        if (n && n->proxy && pw_proxy_get_id(n->proxy) == id)
+            return 1;
+        if (dev && dev->proxy && pw_proxy_get_id(dev->proxy) == id)
+            return 1;
+    }
+    return 0;
+}
+
+static void core_error(void *data, uint32_t id, int seq, int res, const char *message)
+{
+    struct pmixer_priv *priv = data;
+    struct pw_backend *b = priv->pw;
+
+    if (id != PW_ID_CORE) {
+        log_err("PipeWire error on object %u: %s", id, message);
+        for (struct request *r = b->requests; r; r = r->next) {
+            if (uses_proxy(b, r, id))
+                r->failed = 1;
+        }
+        return;
+    }
+
+    /* The connection is gone, so nothing in flight will be answered. */
+    snprintf(b->error, sizeof(b->error), "%s", message);
+    while (b->requests)
+        finish_request(b->requests, -1);
+    priv->state = ERROR;
+    notify(priv);
+}
+
+static const struct pw_core_events core_events = {
+    PW_VERSION_CORE_EVENTS,
+    .done = core_done,
+    .error = core_error,
+};
+
+static void json_name(const char *value, char *name, size_t size)
+{
+    struct spa_json it[2];
+    char key[16];
+    const char *v;
+
+    spa_json_init(&it[0], value, strlen(value));
+    if (spa_json_enter_object(&it[0], &it[1]) <= 0)
+        return;
+    while (spa_json_get_string(&it[1], key, sizeof(key)) > 0) {
+        if (strcmp(key, "name") == 0) {
+            spa_json_get_string(&it[1], name, (int)size);
+            return;
+        }
+        if (spa_json_next(&it[1], &v) <= 0)
+            return;
+    }
+}
+
+static int metadata_property(void *data, uint32_t subject, const char *key, const char *type, const char *value)
+{
+    struct pmixer_priv *priv = data;
+    struct pw_backend *b = priv->pw;
+
+    if (subject != PW_ID_CORE)
+        return 0;
+    /* A NULL key clears every property. */
+    if (!key || strcmp(key, "default.audio.sink") == 0) {
+        b->default_sink[0] = '\0';
+        if (key && value)
+            json_name(value, b->default_sink, sizeof(b->default_sink));
+    }
+    if (!key || strcmp(key, "default.audio.source") == 0) {
+        b->default_source[0] = '\0';
+        if (key && value)
+            json_name(value, b->default_source, sizeof(b->default_source));
+    }
+    return 0;
+}
+
+static const struct pw_metadata_events metadata_events = {
+    PW_VERSION_METADATA_EVENTS,
+    .property = metadata_property,
+};
+
+static void node_info(void *data, const struct pw_node_info *info)
+{
+    struct node *n = data;
+    const char *value;
+
+    if (!info->props)
+        return;
+    /* Which of the card's devices this node plays to or records from. */
+    value = spa_dict_lookup(info->props, "card.profile.device");
+    if (value)
+        n->card_device = atoi(value);
+}
+
+static void node_param(void *data, int seq, uint32_t id, uint32_t index, uint32_t next, const struct spa_pod *param)
+{
+    struct node *n = data;
+    const struct spa_pod_prop *prop;
+
+    if (id != SPA_PARAM_Props || !spa_pod_is_object_type(param, SPA_TYPE_OBJECT_Props))
+        return;
+    /* Still ahead of the server: keep what we wrote, and read again later. */
+    if (n->holds) {
+        n->stale = 1;
+        return;
+    }
+
+    SPA_POD_OBJECT_FOREACH((const struct spa_pod_object *)param, prop) {
+        switch (prop->key) {
+            case SPA_PROP_channelVolumes:
+                n->channels = spa_pod_copy_array(&prop->value, SPA_TYPE_Float,
+                                                 n->volumes, SPA_AUDIO_MAX_CHANNELS);
+                break;
+            case SPA_PROP_mute:
+                spa_pod_get_bool(&prop->value, &n->mute);
+                break;
+        }
+    }
+}
+
+static const struct pw_node_events node_events = {
+    PW_VERSION_NODE_EVENTS,
+    .info = node_info,
+    .param = node_param,
+};
+
+static void device_param(void *data, int seq, uint32_t id, uint32_t index, uint32_t next, const struct spa_pod *param)
+{
+    struct device *dev = data;
+    int32_t route;
+    int32_t card_device;
+    uint32_t i;
+
+    if (id != SPA_PARAM_Route ||
+        spa_pod_parse_object(param, SPA_TYPE_OBJECT_ParamRoute, NULL,
+                             SPA_PARAM_ROUTE_index, SPA_POD_Int(&route),
+                             SPA_PARAM_ROUTE_device, SPA_POD_Int(&card_device)) < 0)
+        return;
+
+    for (i = 0; i < dev->nroutes && dev->routes[i].device != card_device; i++)
+        ;
+    if (i == ROUTE_MAX)
+        return;
+    if (i == dev->nroutes)
+        dev->nroutes++;
+    dev->routes[i].index = route;
+    dev->routes[i].device = card_device;
+}
+
+static const struct pw_device_events device_events = {
+    PW_VERSION_DEVICE_EVENTS,
+    .param = device_param,
+};
+
+/* Subscribing also sends the current value, answered before any later sync. */
+static int bind_node(struct pmixer_priv *priv, struct node *n)
+{
+    struct pw_backend *b = priv->pw;
+    struct device *dev = find_device(b, n->device_id);
+    uint32_t props[] = { SPA_PARAM_Props };
+    uint32_t routes[] = { SPA_PARAM_Route };
+
+    if (!n->proxy) {
+        n->proxy = pw_registry_bind(b->registry, n->id, PW_TYPE_INTERFACE_Node, PW_VERSION_NODE, 0);
+        check(n->proxy, "Can't bind node %u.", n->id);
+        pw_node_add_listener((struct pw_node *)n->proxy, &n->listener, &node_events, n);
+        pw_node_subscribe_params((struct pw_node *)n->proxy, props, 1);
+    }
+    if (dev && !dev->proxy) {
+        dev->proxy = pw_registry_bind(b->registry, dev->id, PW_TYPE_INTERFACE_Device, PW_VERSION_DEVICE, 0);
+        check(dev->proxy, "Can't bind device %u.", dev->id);
+        pw_device_add_listener((struct pw_device *)dev->proxy, &dev->listener, &device_events, dev);
+        pw_device_subscribe_params((struct pw_device *)dev->proxy, routes, 1);
+    }
+    return 0;
+
+error:
+    return -1;
+}
+
+static void registry_global(void *data, uint32_t id, uint32_t permissions, const char *type,
+                            uint32_t version, const struct spa_dict *props)
+{
+    struct pmixer_priv *priv = data;
+    struct pw_backend *b = priv->pw;
+    const char *value;
+    struct node *n;
+
+    if (!props)
+        return;
+
+    if (strcmp(type, PW_TYPE_INTERFACE_Metadata) == 0) {
+        value = spa_dict_lookup(props, PW_KEY_METADATA_NAME);
+        if (b->metadata || !value || strcmp(value, "default") != 0)
+            return;
+        b->metadata = pw_registry_bind(b->registry, id, PW_TYPE_INTERFACE_Metadata, PW_VERSION_METADATA, 0);
+        check(b->metadata, "Can't bind default metadata.");
+        pw_metadata_add_listener((struct pw_metadata *)b->metadata, &b->metadata_listener, &metadata_events, priv);
+        return;
+    }
+
+    if (strcmp(type, PW_TYPE_INTERFACE_Device) == 0) {
+        struct device *dev;
+
+        value = spa_dict_lookup(props, PW_KEY_MEDIA_CLASS);
+        if (!value || strcmp(value, "Audio/Device") != 0)
+            return;
+        dev = calloc(1, sizeof(struct device));
+        check_mem(dev);
+        dev->id = id;
+        dev->next = b->devices;
+        b->devices = dev;
+        return;
+    }
+
+    if (strcmp(type, PW_TYPE_INTERFACE_Node) != 0)
+        return;
+    value = spa_dict_lookup(props, PW_KEY_MEDIA_CLASS);
+    if (!value || (strcmp(value, "Audio/Sink") != 0 && strcmp(value, "Audio/Source") != 0 &&
+                   strcmp(value, "Stream/Output/Audio") != 0))
+        return;
+
+    n = calloc(1, sizeof(struct node));
+    check_mem(n);
+    n->id = id;
+    n->type = strcmp(value, "Audio/Sink") == 0 ? TARGET_SINK :
+              strcmp(value, "Audio/Source") == 0 ? TARGET_SOURCE : TARGET_SINK_INPUT;
+    copy_prop(n->name, sizeof(n->name), props, PW_KEY_NODE_NAME);
+    copy_prop(n->app, sizeof(n->app), props, PW_KEY_APP_NAME);
+    copy_prop(n->binary, sizeof(n->binary), props, PW_KEY_APP_PROCESS_BINARY);
+    value = spa_dict_lookup(props, PW_KEY_DEVICE_ID);
+    n->device_id = value ? strtoul(value, NULL, 10) : SPA_ID_INVALID;
+    n->card_device = -1;
+    n->next = b->nodes;
+    b->nodes = n;
+    if (b->tracking)
+        bind_node(priv, n);
+
+error:
+    return;
+}
+
+static void registry_global_remove(void *data, uint32_t id)
+{
+    struct pmixer_priv *priv = data;
+    struct node **p;
+    struct device **d;
+
+    for (p = &priv->pw->nodes; *p; p = &(*p)->next) {
+        if ((*p)->id == id) {
+            struct node *n = *p;
+            *p = n->next;
+            free_node(n);
+            return;
+        }
+    }
+    for (d = &priv->pw->devices; *d; d = &(*d)->next) {
+        if ((*d)->id == id) {
+            struct device *dev = *d;
+            *d = dev->next;
+            free_device(dev);
+            return;
+        }
+    }
+}
+
+static const struct pw_registry_events registry_events = {
+    PW_VERSION_REGISTRY_EVENTS,
+    .global = registry_global,
+    .global_remove = registry_global_remove,
+};
+
+static void timeout_cb(void *data, uint64_t expirations)
+{
+    struct pmixer_priv *priv = data;
+
+    if (priv->state == CONNECTING)
+        priv->state = TIMEOUT;
+}
+
+/* Requests still in flight are dropped without their callbacks. */
+static void close_core(struct pmixer_priv *priv)
+{
+    struct pw_backend *b = priv->pw;
+
+    while (b->requests) {
+        struct request *r = b->requests;
+        b->requests = r->next;
+        priv->inflight--;
+        free_request(r);
+    }
+    while (b->nodes) {
+        struct node *n = b->nodes;
+        b->nodes = n->next;
+        free_node(n);
+    }
+    while (b->devices) {
+        struct device *dev = b->devices;
+        b->devices = dev->next;
+        free_device(dev);
+    }
+    if (b->metadata) {
+        spa_hook_remove(&b->metadata_listener);
+        pw_proxy_destroy(b->metadata);
+        b->metadata = NULL;
+    }
+    if (b->registry) {
+        spa_hook_remove(&b->registry_listener);
+        pw_proxy_destroy((struct pw_proxy *)b->registry);
+        b->registry = NULL;
+    }
+    if (b->core) {
+        spa_hook_remove(&b->core_listener);
+        pw_core_disconnect(b->core);
+        b->core = NULL;
+    }
+    b->default_sink[0] = '\0';
+    b->default_source[0] = '\0';
+}
+
+/* Sends the requests and returns; state_notify hears how it went. */
+static int open_core(struct pmixer_priv *priv)
+{
+    struct pw_backend *b = priv->pw;
+    struct pw_properties *props = priv->server ? pw_properties_new(PW_KEY_REMOTE_NAME, priv->server, NULL) : NULL;
+
+    priv->state = CONNECTING;
+    b->connect_phase = 0;
+    b->error[0] = '\0';
+    b->core = pw_context_connect(b->context, props, 0);
+    if (!b->core)
+        snprintf(b->error, sizeof(b->error), "%s", strerror(errno));
+    check(b->core, "Can't connect to PipeWire.");
+    pw_core_add_listener(b->core, &b->core_listener, &core_events, priv);
+
+    b->registry = pw_core_get_registry(b->core, PW_VERSION_REGISTRY, 0);
+    check(b->registry, "Can't get PipeWire registry.");
+    pw_registry_add_listener(b->registry, &b->registry_listener, &registry_events, priv);
+    b->connect_seq = pw_core_sync(b->core, PW_ID_CORE, 0);
+    return 0;
+
+error:
+    priv->state = ERROR;
+    return -1;
+}
+
+int setup_mainloop(struct pmixer_priv *priv)
+{
+    return unsupported("Talking to several servers");
+}
+
+int setup_context(struct pmixer_priv *priv)
+{
+    struct pw_backend *b;
+
+    pw_init(NULL, NULL);
+    b = priv->pw = calloc(1, sizeof(struct pw_backend));
+    check_mem(b);
+
+    b->loop = pw_main_loop_new(NULL);
+    check(b->loop, "Can't create PipeWire loop.");
+    b->context = pw_context_new(pw_main_loop_get_loop(b->loop), NULL, 0);
+    check(b->context, "Can't create PipeWire context.");
+    b->timer = pw_loop_add_timer(pw_main_loop_get_loop(b->loop), timeout_cb, priv);
+    check(b->timer, "Can't create PipeWire timer.");
+    pw_loop_enter(pw_main_loop_get_loop(b->loop));
+    return 0;
+
+error:
+    return -1;
+}
+
+int connect_server(struct pmixer_priv *priv, const char *server, int no_autospawn, unsigned timeout_ms)
+{
+    struct pw_backend *b = priv->pw;
+
+    priv->server = server;
+    priv->connect_timeout_ms = timeout_ms;
+    check(open_core(priv) == 0, "Can't connect.");
+    if (timeout_ms)
+        arm_timer(get_loop(priv), b->timer, timeout_ms);
+
+    while (priv->state == CONNECTING) {
+        int rc = pw_loop_iterate(get_loop(priv), -1);
+        if (rc < 0 && rc != -EINTR)
+            break;
+    }
+    arm_timer(get_loop(priv), b->timer, 0);
+    if (priv->state == TIMEOUT) {
+        priv->timed_out = 1;
+        sentinel("Timed out connecting after %ums.", timeout_ms);
+    }
+    check(priv->state == CONNECTED, "Can't connect: %s", server_error(priv));
+    return 0;
+
+error:
+    if (priv->state == CONNECTING)
+        priv->state = ERROR;
+    return -1;
+}
+
+int start_connect(struct pmixer_priv *priv)
+{
+    close_core(priv);
+    return open_core(priv);
+}
+
+void stop_connect(struct pmixer_priv *priv)
+{
+    close_core(priv);
+}
+
+const char *server_error(struct pmixer_priv *priv)
+{
+    return priv->pw->error[0] ? priv->pw->error : "Unknown error";
+}
+
+void teardown_context(struct pmixer_priv *priv)
+{
+    struct pw_backend *b = priv->pw;
+
+    if (!b)
+        return;
+
+    close_core(priv);
+    if (b->timer)
+        pw_loop_destroy_source(pw_main_loop_get_loop(b->loop), b->timer);
+    if (b->context)
+        pw_context_destroy(b->context);
+    if (b->loop) {
+        pw_loop_leave(pw_main_loop_get_loop(b->loop));
+        pw_main_loop_destroy(b->loop);
+    }
+    free(b);
+    priv->pw = NULL;
+    pw_deinit();
+}
+
+/* Tracking keeps every node and card bound, so commands only cost the write. */
+int cache_start(struct pmixer_priv *priv)
+{
+    struct pw_backend *b = priv->pw;
+
+    b->tracking = 1;
+    for (struct node *n = b->nodes; n; n = n->next)
+        check(bind_node(priv, n) == 0, "Can't track %s %s.", target_name(n->type), n->name);
+    return 0;
+
+error:
+    return -1;
+}
+
+void cache_stop(struct pmixer_priv *priv)
+{
+    priv->pw->tracking = 0;
+}
+
+const char *target_name(enum target_type type)
+{
+    switch (type) {
+        case TARGET_SOURCE:
+            return "source";
+        case TARGET_SINK_INPUT:
+            return "stream";
+        default:
+            return "sink";
+    }
+}
+
+static int matches(const struct pw_backend *b, const struct node *n, const struct selector *selector)
+{
+    if (n->type != selector->type)
+        return 0;
+    if (!selector->pattern)
+        return strcmp(n->name, n->type == TARGET_SOURCE ? b->default_source : b->default_sink) == 0;
+    if (n->type != TARGET_SINK_INPUT)
+        return fnmatch(selector->pattern, n->name, 0) == 0;
+    return (n->app[0] && fnmatch(selector->pattern, n->app, 0) == 0) ||
+           (n->binary[0] && fnmatch(selector->pattern, n->binary, 0) == 0);
+}
+
+#ifndef NDEBUG
+/* Same shape as pa_cvolume_snprint(), "0: 50% 1: 45%". */
+static const char *format_level(char *buf, size_t size, const struct level *l)
+{
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (uint32_t c = 0; c < l->channels && len < size; c++)
+        len += snprintf(buf + len, size - len, "%s%u: %.0f%%", c ? " " : "", c, l->volumes[c] * 100);
+    return buf;
+}
+#endif
+
+static void apply_level(struct level *l, const struct command *command)
+{
+    double max = 0;
+    double target;
+
+    for (uint32_t c = 0; c < l->channels; c++)
+        max = l->volumes[c] > max ? l->volumes[c] : max;
+
+    switch (command->cmd) {
+        case CMD_MUTE:
+            l->mute = !l->mute;
+            return;
+        case CMD_MUTE_ON:
+            l->mute = 1;
+            return;
+        case CMD_MUTE_OFF:
+            l->mute = 0;
+            return;
+        case CMD_INC:
+        case CMD_DEC:
+            target = step_volume(max, command->cmd == CMD_INC);
+            break;
+        case CMD_SET:
+            target = command->percent / 100.0;
+            break;
+        default:
+            return;
+    }
+
+    /* Scale every channel so the loudest lands on target, keeping balance. */
+    for (uint32_t c = 0; c < l->channels; c++)
+        l->volumes[c] = max > 0 ? l->volumes[c] * target / max : target;
+}
+
+static struct spa_pod *build_props(struct spa_pod_builder *builder, uint32_t id,
+                                   const struct level *l, int volume, int mute)
+{
+    struct spa_pod_frame frame;
+    float volumes[SPA_AUDIO_MAX_CHANNELS];
+
+    spa_pod_builder_push_object(builder, &frame, SPA_TYPE_OBJECT_Props, id);
+    if (volume) {
+        for (uint32_t c = 0; c < l->channels; c++)
+            volumes[c] = l->volumes[c] * l->volumes[c] * l->volumes[c];
+        spa_pod_builder_prop(builder, SPA_PROP_channelVolumes, 0);
+        spa_pod_builder_array(builder, sizeof(float), SPA_TYPE_Float, l->channels, volumes);
+    }
+    if (mute) {
+        spa_pod_builder_prop(builder, SPA_PROP_mute, 0);
+        spa_pod_builder_bool(builder, l->mute);
+    }
+    return spa_pod_builder_pop(builder, &frame);
+}
+
+static int32_t route_index(const struct device *dev, int32_t card_device)
+{
+    if (!dev || !dev->proxy || card_device < 0)
+        return -1;
+    for (uint32_t i = 0; i < dev->nroutes; i++) {
+        if (dev->routes[i].device == card_device)
+            return dev->routes[i].index;
+    }
+    return -1;
+}
+
+/* Like pipewire-pulse, card nodes are written through the active Route, so
+ * the session manager stores the volume with the port. Streams and nodes
+ * without a card take node Props. */
+static void write_level(const struct pw_backend *b, const struct node *n, const struct level *l,
+                        int volume, int mute)
+{
+    uint8_t buffer[1024];
+    struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    struct device *dev = find_device(b, n->device_id);
+    int32_t route = route_index(dev, n->card_device);
+    struct spa_pod_frame frame;
+    struct spa_pod *param;
+
+    if (route < 0) {
+        param = build_props(&builder, SPA_PARAM_Props, l, volume, mute);
+        pw_node_set_param((struct pw_node *)n->proxy, SPA_PARAM_Props, 0, param);
+        return;
+    }
+
+    spa_pod_builder_push_object(&builder, &frame, SPA_TYPE_OBJECT_ParamRoute, SPA_PARAM_Route);
+    spa_pod_builder_add(&builder,
+                        SPA_PARAM_ROUTE_index, SPA_POD_Int(route),
+                        SPA_PARAM_ROUTE_device, SPA_POD_Int(n->card_device), 0);
+    spa_pod_builder_prop(&builder, SPA_PARAM_ROUTE_props, 0);
+    build_props(&builder, SPA_PARAM_Route, l, volume, mute);
+    spa_pod_builder_prop(&builder, SPA_PARAM_ROUTE_save, 0);
+    spa_pod_builder_bool(&builder, true);
+    param = spa_pod_builder_pop(&builder, &frame);
+    pw_device_set_param((struct pw_device *)dev->proxy, SPA_PARAM_Route, 0, param);
+}
+
+/* Nodes written are held until the final sync, and keep the volume we
+ * wrote meanwhile so the next request steps from it. */
+static void write_request(struct request *r)
+{
+    struct pw_backend *b = r->priv->pw;
+
+    r->writing = 1;
+    for (size_t i = 0; i < r->nids; i++) {
+        struct node *n = find_node(b, r->ids[i]);
+        struct level before = { 0 };
+        struct level after;
+
+        if (!n)
+            continue;
+        if (n->channels == 0) {
+            log_err("No volume on node %u (%s).", n->id, n->name);
+            r->failed = 1;
+            continue;
+        }
+
+        before.channels = n->channels;
+        before.mute = n->mute;
+        for (uint32_t c = 0; c < n->channels; c++)
+            before.volumes[c] = cbrt(n->volumes[c]);
+
+        after = before;
+        for (size_t j = 0; j < r->count; j++)
+            apply_level(&after, &r->commands[j]);
+
+#ifndef NDEBUG
+        if (log_level >= LOG_DEBUG) {
+            char from[16 * SPA_AUDIO_MAX_CHANNELS];
+            char to[16 * SPA_AUDIO_MAX_CHANNELS];
+
+            debug("got %s %u (%s), volume %s -> %s", target_name(n->type), n->id, n->name,
+                  format_level(from, sizeof(from), &before), format_level(to, sizeof(to), &after));
+        }
+#endif
+
+        int volume = memcmp(before.volumes, after.volumes, sizeof(double) * before.channels) != 0;
+        int mute = before.mute != after.mute;
+        if (!volume && !mute)
+            continue;
+
+        write_level(b, n, &after, volume, mute);
+        for (uint32_t c = 0; c < n->channels; c++)
+            n->volumes[c] = after.volumes[c] * after.volumes[c] * after.volumes[c];
+        n->mute = after.mute;
+        n->holds++;
+        r->ids[r->nheld++] = n->id;
+    }
+    sync_request(r);
+}
+
+static void request_timeout_cb(void *data, uint64_t expirations)
+{
+    struct request *r = data;
+
+    r->priv->timed_out = 1;
+    finish_request(r, -ETIMEDOUT);
+}
+
+/* Nodes not read yet cost a sync first; after that it is the writes and
+ * one more sync to hear they were applied. */
+int submit_commands(struct pmixer_priv *priv, const struct selector *selector,
+                    const struct command *commands, size_t count,
+                    request_cb_t cb, void *raw)
+{
+    struct pw_backend *b = priv->pw;
+    struct request *r = NULL;
+    int reading = 0;
+    size_t i = 0;
+
+    check(priv->state == CONNECTED, "Not connected.");
+    check(selector->pattern || selector->type != TARGET_SINK_INPUT, "Streams need a pattern.");
+    r = calloc(1, sizeof(struct request));
+    check_mem(r);
+    r->priv = priv;
+    r->type = selector->type;
+    r->started = now_usec();
+    r->cb = cb;
+    r->raw = raw;
+    if (count) {
+        r->commands = malloc(count * sizeof(struct command));
+        check_mem(r->commands);
+        memcpy(r->commands, commands, count * sizeof(struct command));
+    }
+    r->count = count;
+    for (size_t j = 0; j < count; j++)
+        metrics_command(r->type, commands[j].cmd);
+
+    for (struct node *n = b->nodes; n; n = n->next)
+        r->nids += matches(b, n, selector);
+    if (r->nids == 0) {
+        if (selector->pattern)
+            log_err("No %s matches %s", target_name(selector->type), selector->pattern);
+        else
+            log_err("Unable to get info for default %s.", target_name(selector->type));
+        goto error;
+    }
+    r->ids = calloc(r->nids, sizeof(uint32_t));
+    check_mem(r->ids);
+    for (struct node *n = b->nodes; n; n = n->next) {
+        if (!matches(b, n, selector))
+            continue;
+        r->ids[i++] = n->id;
+        reading |= !n->proxy || n->channels == 0;
+        check(bind_node(priv, n) == 0, "Can't read %s %s.", target_name(n->type), n->name);
+    }
+    if (b->tracking)
+        metrics_cache(!reading);
+
+    if (priv->op_timeout_ms) {
+        r->timer = pw_loop_add_timer(get_loop(priv), request_timeout_cb, r);
+        check(r->timer, "Can't create PipeWire timer.");
+        arm_timer(get_loop(priv), r->timer, priv->op_timeout_ms);
+    }
+    r->next = b->requests;
+    b->requests = r;
+    priv->inflight++;
+    metrics_inflight(priv->inflight);
+
+    if (reading)
+        sync_request(r);
+    else
+        write_request(r);
+    return 0;
+
+error:
+    if (r)
+        free_request(r);
+    return -1;
+}
+
+int wait_ops(struct pmixer_priv *priv)
+{
+    while (priv->inflight > 0) {
+        int rc = pw_loop_iterate(get_loop(priv), -1);
+        if (rc < 0 && rc != -EINTR)
+            return -1;
+    }
+    return priv->state == CONNECTED ? 0 : -1;
+}
+
+static void run_done_cb(struct pmixer_priv *priv, int rc, const struct target *targets, size_t ntargets, void *raw)
+{
+    *(int *)raw = rc;
+}
+
+int run_commands(struct pmixer_priv *priv, const struct selector *selector,
+                 const struct command *commands, size_t count)
+{
+    int rc = -1;
+
+    check(submit_commands(priv, selector, commands, count, run_done_cb, &rc) == 0, "Can't run commands.");
+    check(wait_ops(priv) == 0, "Lost connection to server.");
+    return rc;
+
+error:
+    return -1;
+}
+
+int run_command(struct pmixer_priv *priv, const struct selector *selector, const struct command *command)
+{
+    return run_commands(priv, selector, command, 1);
+}
+
+struct loop_io {
+    struct pw_loop *loop;
+    struct spa_source *source;
+    loop_io_cb_t cb;
+    void *raw;
+};
+
+struct loop_timer {
+    struct pw_loop *loop;
+    struct spa_source *source;
+    loop_timer_cb_t cb;
+    void *raw;
+};
+
+static uint32_t io_mask(int events)
+{
+    return (events & LOOP_IN ? SPA_IO_IN : 0) | (events & LOOP_OUT ? SPA_IO_OUT : 0);
+}
+
+static void io_cb(void *data, int fd, uint32_t mask)
+{
+    struct loop_io *io = data;
+    io->cb(io, fd, io->raw);
+}
+
+struct loop_io *loop_io_new(struct pmixer_priv *priv, int fd, int events, loop_io_cb_t cb, void *raw)
+{
+    struct loop_io *io = calloc(1, sizeof(struct loop_io));
+
+    check_mem(io);
+    io->loop = get_loop(priv);
+    io->cb = cb;
+    io->raw = raw;
+    io->source = pw_loop_add_io(io->loop, fd, io_mask(events), false, io_cb, io);
+    check_mem(io->source);
+    return io;
+
+error:
+    free(io);
+    return NULL;
+}
+
+void loop_io_enable(struct loop_io *io, int events)
+{
+    pw_loop_update_io(io->loop, io->source, io_mask(events));
+}
+
+void loop_io_free(struct loop_io *io)
+{
+    pw_loop_destroy_source(io->loop, io->source);
+    free(io);
+}
+
+static void timer_cb(void *data, uint64_t expirations)
+{
+    struct loop_timer *timer = data;
+    timer->cb(timer, timer->raw);
+}
+
+struct loop_timer *loop_timer_new(struct pmixer_priv *priv, loop_timer_cb_t cb, void *raw)
+{
+    struct loop_timer *timer = calloc(1, sizeof(struct loop_timer));
+
+    check_mem(timer);
+    timer->loop = get_loop(priv);
+    timer->cb = cb;
+    timer->raw = raw;
+    timer->source = pw_loop_add_timer(timer->loop, timer_cb, timer);
+    check_mem(timer->source);
+    return timer;
+
+error:
+    free(timer);
+    return NULL;
+}
+
+void loop_timer_arm(struct loop_timer *timer, unsigned ms)
+{
+    arm_timer(timer->loop, timer->source, ms);
+}
+
+void loop_timer_free(struct loop_timer *timer)
+{
+    pw_loop_destroy_source(timer->loop, timer->source);
+    free(timer);
+}
+
+static void signal_cb(void *data, int sig)
+{
+    struct loop_signal *s = data;
+    s->cb(sig, s->raw);
+}
+
+/* The loop sets signals up one by one as they are added. */
+int loop_signals_init(struct pmixer_priv *priv)
+{
+    return 0;
+}
+
+int loop_signal(struct pmixer_priv *priv, int sig, loop_signal_cb_t cb, void *raw)
+{
+    struct pw_backend *b = priv->pw;
+    struct loop_signal *s = &b->signals[b->nsignals];
+
+    check(b->nsignals < SIGNAL_MAX, "Too many signal handlers.");
+    s->cb = cb;
+    s->raw = raw;
+    s->source = pw_loop_add_signal(get_loop(priv), sig, signal_cb, s);
+    check_mem(s->source);
+    b->nsignals++;
+    return 0;
+
+error:
+    return -1;
+}
+
+void loop_signals_done(struct pmixer_priv *priv)
+{
+    struct pw_backend *b = priv->pw;
+
+    while (b->nsignals > 0)
+        pw_loop_destroy_source(get_loop(priv), b->signals[--b->nsignals].source);
+}
+
+int loop_iterate(struct pmixer_priv *priv)
+{
+    int rc = pw_loop_iterate(get_loop(priv), -1);
+
+    return rc < 0 && rc != -EINTR ? -1 : 0;
+}
+
+int run_get(struct pmixer_priv *priv, const struct selector *selector, enum output_format format)
+{
+    return unsupported("get");
+}
+
+int run_keys(struct pmixer_priv *priv, const char *device)
+{
+    return unsupported("--listen-keys");
+}
+
+int run_save(struct pmixer_priv *priv, const char *path)
+{
+    return unsupported("save");
+}
+
+int run_restore(struct pmixer_priv *priv, const char *path)
+{
+    return unsupported("restore");
+}
+
+int run_watch(struct pmixer_priv *priv)
+{
+    return unsupported("watch");
+}
+
+int run_meter(struct pmixer_priv *priv, unsigned rate)
+{
+    return unsupported("meter");
+}
+
+int run_fade(struct pmixer_priv *priv, const struct selector *selector,
+             unsigned percent, unsigned duration_ms, unsigned rate)
+{
+    return unsupported("fade");
+}
+
+int run_fanout(struct pmixer_priv *priv, const struct fanout_options *options, const struct batch *batch)
+{
+    return unsupported("Talking to several servers");
+}
@@ -1,153 +1,10 @@
-#include <stdio.h>
-#include <errno.h>
-#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <math.h>
 #include <argp.h>
 
-#include <pulse/pulseaudio.h>
-
-#define clean_errno() (errno == 0 ? "None" : strerror(errno))
-
-#define log_err(M, ...) fprintf(stderr, "[ERROR] (%s:%d: errno: %s) " M "\n", __FILE__, __LINE__, clean_errno(), ##__VA_ARGS__)
-#define log_warn(M, ...) fprintf(stderr, "[WARN] (%s:%d: errno: %s) " M "\n", __FILE__, __LINE__, clean_errno(), ##__VA_ARGS__)
-#define log_info(M, ...) fprintf(stderr, "[INFO] (%s:%d) " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
-
-#define check(A, M, ...) if(!(A)) { log_err(M, ##__VA_ARGS__); errno=0; goto error; }
-
-#define sentinel(M, ...)  { log_err(M, ##__VA_ARGS__); errno=0; goto error; }
-
-#define check_mem(A) check((A), "Out of memory.")
-
-typedef enum {
-    CONNECTING,
-    CONNECTED,
-    ERROR,
-} state_t;
-
-state_t state;
-
-struct sink_info {
-    uint32_t index;
-    int mute;
-    pa_cvolume volume;
-};
-
-struct pmixer_priv {
-    pa_mainloop *mainloop;
-    pa_mainloop_api *mainloop_api;
-    pa_context *context;
-};
-
-void state_cb(pa_context *context, void* raw)
-{
-    switch(pa_context_get_state(context)) {
-        case PA_CONTEXT_READY:
-            state = CONNECTED;
-            break;
-        case PA_CONTEXT_FAILED:
-            state = ERROR;
-            break;
-        case PA_CONTEXT_UNCONNECTED:
-        case PA_CONTEXT_AUTHORIZING:
-        case PA_CONTEXT_SETTING_NAME:
-        case PA_CONTEXT_CONNECTING:
-        case PA_CONTEXT_TERMINATED:
-            break;
-        default:
-            sentinel("pa_context in unexpected state.");
-            break;
-    }
-error:
-    return;
-}
-
-void sink_info_cb(pa_context *c, const pa_sink_info *info, int eol, void *raw)
-{
-    if (eol != 0) return;
-
-    struct sink_info *i = *(struct sink_info **)raw;
-
-    i->index = info->index;
-    i->mute = info->mute;
-    i->volume = info->volume;
-}
-
-void server_info_cb(pa_context *c, const pa_server_info *info, void *raw)
-{
-    char **name = (char **)raw;
-    *name = strdup(info->default_sink_name);
-}
-
-void success_cb(pa_context *c, int success, void *raw)
-{
-}
-
-void iterate(struct pmixer_priv *priv, pa_operation *op)
-{
-    int retval;
-
-    while (pa_operation_get_state(op) == PA_OPERATION_RUNNING) {
-        pa_mainloop_iterate(priv->mainloop, 1, &retval);
-    }
-}
-
-struct sink_info *get_sink(struct pmixer_priv *priv, const char *name)
-{
-    struct sink_info *sink_info = malloc(sizeof(struct sink_info));
-    check_mem(sink_info);
-
-    pa_operation *op = pa_context_get_sink_info_by_name(priv->context, name, sink_info_cb, &sink_info);
-    iterate(priv, op);
-    pa_operation_unref(op);
-
-    check(sink_info, "Unable to get info for sink: %s", name);
-
-    return sink_info;
-
-error:
-    if (sink_info)
-        free(sink_info);
-    return NULL;
-}
-
-struct sink_info *get_default_sink(struct pmixer_priv *priv)
-{
-    char *sink_name = NULL;
-    struct sink_info *sink = NULL;
-
-    pa_operation *op = pa_context_get_server_info(priv->context, server_info_cb, &sink_name);
-    iterate(priv, op);
-    pa_operation_unref(op);
-
-    check(sink_name, "Unable to retrive default sink name");
-    log_info("Default sink name %s", sink_name);
-    sink = get_sink(priv, sink_name);
-    check(sink, "Unable to retrive info for default sink named %s", sink_name);
-    free(sink_name);
-    return sink;
-
-error:
-    if (sink_name)
-        free(sink_name);
-    if (sink)
-        free(sink);
-    return NULL;
-}
-
-void set_volume(struct pmixer_priv *priv, uint32_t index, pa_cvolume *new_volume)
-{
-    pa_operation *op;
-    op = pa_context_set_sink_volume_by_index(priv->context, index, new_volume, success_cb, NULL);
-    iterate(priv, op);
-    pa_operation_unref(op);
-}
-
-void set_mute(struct pmixer_priv * priv, uint32_t index, int mute)
-{
-    pa_operation *op;
-    op = pa_context_set_sink_mute_by_index(priv->context, index, mute, success_cb, NULL);
-    iterate(priv, op);
-    pa_operation_unref(op);
-}
+#include "dbg.h"
+#include "pmixer.h"
 
 const char *argp_program_version = "pmixer 0.1";
 const char *argp_program_bug_address = "phil@dixon.gen.nz";
@@ -155,58 +12,254 @@ const char *argp_program_bug_address = "phil@dixon.gen.nz";
 static char doc[] =
         "pmixer -- Pulse Audio volume control from the shell.";
 
-static char args_doc[] = "<command>";
+static char args_doc[] = "<command> [ARG]\nget\nwatch\nmeter\nfade <percent> <duration>\nsave <file>\nrestore <file>\ntrace\nmetrics";
+
+#define OPT_TIMINGS 256
+#define OPT_LISTEN_KEYS 257
+#define OPT_IDLE_EXIT 258
+#define OPT_SOURCE 259
+#define OPT_BULK_INFLIGHT 260
+#define OPT_STEP 261
 
 static struct argp_option options[] = {
-    {"verbose", 'v', 0, 0, "Enable detailed output"},
+    {"verbose", 'v', 0, 0, "Log progress; repeat for per-command debug output"},
+    {"quiet", 'q', 0, 0, "Only log errors"},
+    {"daemon", 'd', 0, 0, "Stay connected and accept commands on a socket"},
+    {"listen-keys", OPT_LISTEN_KEYS, "DEVICE", OPTION_ARG_OPTIONAL, "Stay connected and apply the volume keys of DEVICE (default every /dev/input/event* that has them)"},
+    {"socket", 's', "PATH", 0, "Daemon socket path"},
+    {"coalesce", 'c', "MS", 0, "Daemon: merge commands arriving within MS milliseconds (default 40, 0 disables)"},
+    {"bulk-inflight", OPT_BULK_INFLIGHT, "N", 0, "Daemon: run at most N bulk commands at once (default 2)"},
+    {"idle-exit", OPT_IDLE_EXIT, "MS", 0, "Daemon: exit after MS milliseconds without a client (default 0, never)"},
+    {"batch", 'b', "FILE", 0, "Run the commands in FILE, one per line ('-' for stdin)"},
+    {"all", 'a', 0, 0, "Apply the command to every sink"},
+    {"sink", 'S', "GLOB", 0, "Apply the command to every sink whose name matches GLOB"},
+    {"source", OPT_SOURCE, "GLOB", OPTION_ARG_OPTIONAL, "Apply the command to the default source, or every source whose name matches GLOB"},
+    {"app", 'A', "GLOB", 0, "Apply the command to every stream whose application name or binary matches GLOB"},
+    {"step", OPT_STEP, "MODE[:SIZE]", 0, "inc/dec step: cubic (default, 5%), linear (5% amplitude) or db (2dB)"},
+    {"format", 'f', "FORMAT", 0, "get: print plain, json or shell (default plain)"},
+    {"rate", 'r', "HZ", 0, "Meter and fade: updates per second (default 25)"},
+    {"connect-timeout", 'T', "MS", 0, "Give up connecting after MS milliseconds (default 2000, 0 waits forever)"},
+    {"timeout", 't', "MS", 0, "Cancel any server request not answered within MS milliseconds (default 2000, 0 waits forever)"},
+    {"no-autospawn", 'n', 0, 0, "Fail instead of spawning a server when none is running"},
+    {"server", 'H', "LIST", 0, "Server(s) to talk to, comma separated or @FILE with one per line (may be repeated)"},
+    {"parallel", 'j', "N", 0, "With several servers, talk to at most N at once (default 32, 0 for no limit)"},
+    {"timings", OPT_TIMINGS, "FORMAT", OPTION_ARG_OPTIONAL, "Report how long each phase took on stderr (FORMAT is text or json)"},
     { 0 }
 };
 
-enum commands {
-    CMD_NOP,
-    CMD_INC,
-    CMD_DEC,
-    CMD_MUTE
+enum modes {
+    MODE_COMMAND,
+    MODE_GET,
+    MODE_WATCH,
+    MODE_METER,
+    MODE_FADE,
+    MODE_SAVE,
+    MODE_RESTORE,
+    MODE_TRACE,
+    MODE_METRICS,
 };
 
-struct cmd_map {
-    enum commands cmd;
+struct mode_map {
+    enum modes mode;
     char *text;
 };
 
-struct cmd_map cmd_map[] = {
-    {CMD_INC, "inc"},
-    {CMD_DEC, "dec"},
-    {CMD_MUTE, "mute"},
+static struct mode_map mode_map[] = {
+    {MODE_GET, "get"},
+    {MODE_WATCH, "watch"},
+    {MODE_METER, "meter"},
+    {MODE_FADE, "fade"},
+    {MODE_SAVE, "save"},
+    {MODE_RESTORE, "restore"},
+    {MODE_TRACE, "trace"},
+    {MODE_METRICS, "metrics"},
     { 0 }
 };
 
 struct arguments {
-    enum commands command;
-    int verbose;
+    enum modes mode;
+    const char *verb;
+    const char *verb_arg;
+    const char *duration_arg;
+    struct command command;
+    unsigned fade_ms;
+    int daemon;
+    int listen_keys;
+    const char *keys_device;
+    struct daemon_options daemon_options;
+    const char *batch;
+    struct selector selector;
+    enum output_format format;
+    unsigned rate;
+    unsigned connect_timeout_ms;
+    unsigned op_timeout_ms;
+    int no_autospawn;
+    struct fanout_options fanout;
+    enum timings_format timings_format;
 };
 
+static unsigned parse_unsigned(struct argp_state *state, const char *arg)
+{
+    char *end;
+    unsigned long ms = strtoul(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0')
+        argp_error(state, "invalid number: %s", arg);
+    return ms;
+}
+
+static unsigned parse_duration(struct argp_state *state, const char *arg)
+{
+    char *end;
+    double ms = strtod(arg, &end);
+
+    if (end == arg || ms < 0)
+        argp_error(state, "invalid duration: %s", arg);
+    if (strcmp(end, "s") == 0)
+        ms *= 1000;
+    else if (*end != '\0' && strcmp(end, "ms") != 0)
+        argp_error(state, "invalid duration: %s", arg);
+    if (ms > UINT_MAX)
+        argp_error(state, "duration too long: %s", arg);
+    return (unsigned)lround(ms);
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
     struct arguments *arguments = state->input;
 
     switch(key) {
         case 'v':
-            arguments->verbose = 1;
+            if (log_level < LOG_DEBUG)
+                log_level++;
+            break;
+        case 'q':
+            log_level = LOG_ERR;
+            break;
+        case 'd':
+            arguments->daemon = 1;
+            break;
+        case OPT_LISTEN_KEYS:
+            arguments->listen_keys = 1;
+            arguments->keys_device = arg;
+            break;
+        case 's':
+            arguments->daemon_options.socket_path = arg;
+            break;
+        case 'c':
+            arguments->daemon_options.coalesce_ms = parse_unsigned(state, arg);
+            break;
+        case OPT_BULK_INFLIGHT:
+            arguments->daemon_options.bulk_inflight = parse_unsigned(state, arg);
+            if (arguments->daemon_options.bulk_inflight == 0)
+                argp_error(state, "--bulk-inflight must be at least 1");
+            break;
+        case OPT_IDLE_EXIT:
+            arguments->daemon_options.idle_exit_ms = parse_unsigned(state, arg);
+            break;
+        case 'a':
+            arguments->selector = (struct selector){ TARGET_SINK, "*" };
+            break;
+        case 'S':
+            arguments->selector = (struct selector){ TARGET_SINK, arg };
+            break;
+        case OPT_SOURCE:
+            arguments->selector = (struct selector){ TARGET_SOURCE, arg };
+            break;
+        case 'A':
+            arguments->selector = (struct selector){ TARGET_SINK_INPUT, arg };
+            break;
+        case OPT_STEP:
+            if (parse_step(arg) != 0)
+                argp_error(state, "invalid step: %s", arg);
+            break;
+        case 'f':
+            if (strcmp(arg, "plain") == 0)
+                arguments->format = FORMAT_PLAIN;
+            else if (strcmp(arg, "json") == 0)
+                arguments->format = FORMAT_JSON;
+            else if (strcmp(arg, "shell") == 0)
+                arguments->format = FORMAT_SHELL;
+            else
+                argp_error(state, "unknown format: %s", arg);
+            break;
+        case 'r':
+            arguments->rate = parse_unsigned(state, arg);
+            if (arguments->rate == 0)
+                argp_error(state, "invalid rate: %s", arg);
+            break;
+        case 'T':
+            arguments->connect_timeout_ms = parse_unsigned(state, arg);
+            break;
+        case 't':
+            arguments->op_timeout_ms = parse_unsigned(state, arg);
+            break;
+        case 'n':
+            arguments->no_autospawn = 1;
+            break;
+        case 'H':
+            if (read_servers(arg, &arguments->fanout) != 0)
+                argp_error(state, "can't read servers: %s", arg);
+            break;
+        case 'j':
+            arguments->fanout.parallel = parse_unsigned(state, arg);
+            break;
+        case OPT_TIMINGS:
+            timings_enabled = 1;
+            if (!arg || strcmp(arg, "text") == 0)
+                arguments->timings_format = TIMINGS_TEXT;
+            else if (strcmp(arg, "json") == 0)
+                arguments->timings_format = TIMINGS_JSON;
+            else
+                argp_error(state, "unknown timings format: %s", arg);
+            break;
+        case 'b':
+            arguments->batch = arg;
             break;
         case ARGP_KEY_ARG:
-            if (state->arg_num >= 1)
+            if (state->arg_num >= 3 || arguments->daemon || arguments->batch || arguments->listen_keys)
                 argp_usage(state);
-            for(int i = 0; cmd_map[i].cmd != 0; i++) {
-                if (strcmp(arg, cmd_map[i].text) == 0) {
-                    arguments->command = cmd_map[i].cmd;
-                    break;
-                }
+            if (state->arg_num == 1) {
+                arguments->verb_arg = arg;
+                break;
+            }
+            if (state->arg_num == 2) {
+                arguments->duration_arg = arg;
+                break;
             }
+            for (int i = 0; mode_map[i].text; i++) {
+                if (strcmp(arg, mode_map[i].text) == 0)
+                    arguments->mode = mode_map[i].mode;
+            }
+            arguments->verb = arg;
             break;
         case ARGP_KEY_END:
-            if (state->arg_num < 1)
+            if (state->arg_num < 1 && !arguments->daemon && !arguments->batch && !arguments->listen_keys)
+                argp_usage(state);
+            if (arguments->listen_keys && (arguments->daemon || arguments->batch))
+                argp_error(state, "--listen-keys runs on its own");
+            if (arguments->fanout.nservers > 1 &&
+                (arguments->daemon || arguments->listen_keys || arguments->mode != MODE_COMMAND))
+                argp_error(state, "several servers only work with commands and batches");
+            if (arguments->mode == MODE_FADE) {
+                if (!arguments->duration_arg)
+                    argp_usage(state);
+                if (parse_command("set", arguments->verb_arg, &arguments->command) != 0)
+                    argp_error(state, "invalid fade target: %s", arguments->verb_arg);
+                arguments->fade_ms = parse_duration(state, arguments->duration_arg);
+            } else if (arguments->duration_arg) {
                 argp_usage(state);
+            } else if (arguments->mode == MODE_SAVE || arguments->mode == MODE_RESTORE) {
+                if (!arguments->verb_arg)
+                    argp_usage(state);
+            } else if (arguments->mode != MODE_COMMAND) {
+                if (arguments->verb_arg)
+                    argp_usage(state);
+            } else if (arguments->verb &&
+                       parse_command(arguments->verb, arguments->verb_arg, &arguments->command) != 0) {
+                argp_error(state, "invalid command: %s%s%s", arguments->verb,
+                           arguments->verb_arg ? " " : "", arguments->verb_arg ? arguments->verb_arg : "");
+            }
             break;
         default:
             return ARGP_ERR_UNKNOWN;
@@ -217,59 +270,98 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 
 static struct argp argp = {options, parse_opt, args_doc, doc};
 
-int main(int argc, char *argv[])
+static uint64_t phase_done(const char *name, uint64_t start)
 {
-    struct pmixer_priv priv;
-    struct arguments arguments;
-    int retval;
-    struct sink_info *info = NULL;
-
-    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    uint64_t now = timings_enabled ? now_usec() : 0;
 
-    check_mem(priv.mainloop = pa_mainloop_new());
-    priv.mainloop_api = pa_mainloop_get_api(priv.mainloop);
-    check_mem(priv.mainloop_api);
-    priv.context = pa_context_new(priv.mainloop_api, "pmixer");
-    check_mem(priv.context);
-    pa_context_set_state_callback(priv.context, state_cb, NULL);
-
-    state = CONNECTING;
-    pa_context_connect(priv.context, NULL, PA_CONTEXT_NOFLAGS, NULL);
+    if (timings_enabled)
+        timing_record(name, start, now);
+    return now;
+}
 
-    while (state == CONNECTING) {
-        pa_mainloop_iterate(priv.mainloop, 1, &retval);
+int main(int argc, char *argv[])
+{
+    uint64_t mark = now_usec();
+    struct pmixer_priv priv = { 0 };
+    struct arguments arguments = { 0 };
+    struct batch batch = { 0 };
+    int fanout;
+
+    arguments.daemon_options.socket_path = default_socket_path();
+    arguments.daemon_options.coalesce_ms = 40;
+    arguments.daemon_options.bulk_inflight = 2;
+    arguments.rate = 25;
+    arguments.connect_timeout_ms = 2000;
+    arguments.op_timeout_ms = 2000;
+    arguments.fanout.parallel = 32;
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    priv.op_timeout_ms = arguments.op_timeout_ms;
+    fanout = arguments.fanout.nservers > 1;
+    arguments.fanout.connect_timeout_ms = arguments.connect_timeout_ms;
+    arguments.fanout.no_autospawn = arguments.no_autospawn;
+
+    if (arguments.batch)
+        check(read_batch(arguments.batch, &arguments.selector, &batch) == 0, "Can't read batch %s", arguments.batch);
+    mark = phase_done("startup", mark);
+
+    if (arguments.mode == MODE_TRACE || arguments.mode == MODE_METRICS) {
+        check(fetch_dump(arguments.daemon_options.socket_path, arguments.verb) == 0, "Can't query the daemon.");
+        free_servers(&arguments.fanout);
+        return 0;
     }
-    check(state == CONNECTED, "Can't connect.");
 
-    check(info = get_default_sink(&priv), "Can't get default sink.");
-    log_info("got sink %d, volume %u", info->index, pa_cvolume_avg(&info->volume));
+    check((fanout ? setup_mainloop(&priv) : setup_context(&priv)) == 0, "Can't set up context.");
+    mark = phase_done("setup", mark);
 
-    switch (arguments.command) {
-        case CMD_MUTE:
-            set_mute(&priv, info->index, !info->mute);
-            break;
-        case CMD_INC:
-            set_volume(&priv, info->index, pa_cvolume_inc_clamp(&info->volume, PA_VOLUME_NORM/20, PA_VOLUME_UI_MAX));
-            break;
-        case CMD_DEC:
-            set_volume(&priv, info->index, pa_cvolume_dec(&info->volume, PA_VOLUME_NORM/20));
-            break;
+    if (!fanout) {
+        check(connect_server(&priv, arguments.fanout.nservers ? arguments.fanout.servers[0] : NULL,
+                             arguments.no_autospawn, arguments.connect_timeout_ms) == 0, "Can't connect.");
+        mark = phase_done("connect", mark);
     }
 
-    if (state == CONNECTED)
-        pa_context_disconnect(priv.context);
-    pa_context_unref(priv.context);
-    pa_mainloop_free(priv.mainloop);
+    if (fanout) {
+        struct batch_run run = { arguments.selector, NULL, &arguments.command, 1, 1 };
+        struct batch single = { &run, 1 };
+
+        check(run_fanout(&priv, &arguments.fanout, arguments.batch ? &batch : &single) == 0,
+              "Not every server succeeded.");
+    } else if (arguments.daemon) {
+        check(run_daemon(&priv, &arguments.daemon_options) == 0, "Daemon failed.");
+    } else if (arguments.listen_keys) {
+        check(run_keys(&priv, arguments.keys_device) == 0, "Key listener failed.");
+    } else if (arguments.mode == MODE_GET) {
+        check(run_get(&priv, &arguments.selector, arguments.format) == 0, "Get failed.");
+    } else if (arguments.mode == MODE_WATCH) {
+        check(run_watch(&priv) == 0, "Watch failed.");
+    } else if (arguments.mode == MODE_METER) {
+        check(run_meter(&priv, arguments.rate) == 0, "Meter failed.");
+    } else if (arguments.mode == MODE_FADE) {
+        check(run_fade(&priv, &arguments.selector, arguments.command.percent,
+                       arguments.fade_ms, arguments.rate) == 0, "Fade failed.");
+    } else if (arguments.mode == MODE_SAVE) {
+        check(run_save(&priv, arguments.verb_arg) == 0, "Save failed.");
+    } else if (arguments.mode == MODE_RESTORE) {
+        check(run_restore(&priv, arguments.verb_arg) == 0, "Restore failed.");
+    } else if (arguments.batch) {
+        check(run_batch(&priv, &batch) == 0, "Batch failed.");
+    } else {
+        check(run_command(&priv, &arguments.selector, &arguments.command) == 0, "Command failed.");
+    }
+    mark = phase_done("command", mark);
+
+    teardown_context(&priv);
+    free_batch(&batch);
+    free_servers(&arguments.fanout);
+    phase_done("teardown", mark);
+    if (timings_enabled)
+        timings_print(arguments.timings_format);
     return 0;
 
 error:
-    if (info)
-        free(info);
-    if (state == CONNECTED)
-        pa_context_disconnect(priv.context);
-    if (priv.context)
-        pa_context_unref(priv.context);
-    if (priv.mainloop)
-        pa_mainloop_free(priv.mainloop);
-    return -1;
+    free_batch(&batch);
+    free_servers(&arguments.fanout);
+    teardown_context(&priv);
+    if (timings_enabled)
+        timings_print(arguments.timings_format);
+    return priv.timed_out ? PMIXER_EXIT_TIMEOUT : -1;
 }
@@ -0,0 +1,287 @@
+#ifndef __pmixer_h__
+#define __pmixer_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef PMIXER_PIPEWIRE
+#include <pulse/pulseaudio.h>
+#endif
+
+#include "proto.h"
+
+typedef enum {
+    CONNECTING,
+    CONNECTED,
+    ERROR,
+    TIMEOUT,
+} state_t;
+
+#define SINK_NAME_MAX 256
+
+enum target_type {
+    TARGET_SINK,
+    TARGET_SOURCE,
+    TARGET_SINK_INPUT,
+};
+
+struct selector {
+    enum target_type type;
+    const char *pattern;
+};
+
+struct pmixer_priv;
+
+const char *target_name(enum target_type type);
+
+#define VOLUME_UI_MAX (99957 / 65536.0)    /* PA_VOLUME_UI_MAX / PA_VOLUME_NORM, +11dB */
+
+enum step_mode {
+    STEP_CUBIC,
+    STEP_LINEAR,
+    STEP_DB,
+};
+
+int parse_step(const char *spec);
+double step_volume(double current, int up);
+
+typedef void (*state_notify_cb_t)(struct pmixer_priv *priv, void *raw);
+
+#ifdef PMIXER_PIPEWIRE
+
+struct pw_backend;
+
+struct pmixer_priv {
+    struct pw_backend *pw;
+    state_t state;
+    state_notify_cb_t state_notify;
+    void *state_notify_raw;
+    unsigned inflight;
+    unsigned op_timeout_ms;
+    int timed_out;
+    const char *server;
+    unsigned connect_timeout_ms;
+};
+
+#else
+
+struct device_info {
+    char name[SINK_NAME_MAX];
+    enum target_type type;
+    uint32_t index;
+    int mute;
+    pa_cvolume volume;
+};
+
+struct sink_cache;
+struct tracked_op;
+struct request;
+
+struct pmixer_priv {
+    pa_mainloop *mainloop;
+    pa_mainloop_api *mainloop_api;
+    pa_context *context;
+    state_t state;
+    state_notify_cb_t state_notify;
+    void *state_notify_raw;
+    struct sink_cache *cache;
+    struct tracked_op *ops;
+    struct tracked_op *spare_ops;
+    struct request *spare_requests;
+    unsigned inflight;
+    unsigned op_timeout_ms;
+    int timed_out;
+    const char *server;
+    int no_autospawn;
+    unsigned connect_timeout_ms;
+};
+
+enum op_status {
+    OP_DONE,
+    OP_CANCELLED,
+    OP_TIMEOUT,
+};
+
+int new_context(struct pmixer_priv *priv, const char *name);
+
+void trace_signal_cb(pa_mainloop_api *api, pa_signal_event *e, int sig, void *raw);
+
+#endif
+
+int setup_mainloop(struct pmixer_priv *priv);
+int setup_context(struct pmixer_priv *priv);
+int connect_server(struct pmixer_priv *priv, const char *server, int no_autospawn, unsigned timeout_ms);
+void teardown_context(struct pmixer_priv *priv);
+
+/* Reconnecting: start over on priv->server without waiting, or give up on
+ * an attempt that is taking too long. State changes go to state_notify. */
+int start_connect(struct pmixer_priv *priv);
+void stop_connect(struct pmixer_priv *priv);
+const char *server_error(struct pmixer_priv *priv);
+
+struct reconnect;
+typedef int (*session_cb_t)(struct pmixer_priv *priv, void *raw);
+
+struct reconnect *reconnect_new(struct pmixer_priv *priv, session_cb_t up, session_cb_t down, void *raw);
+void reconnect_free(struct reconnect *r);
+
+/* Events for the long-running modes, on whichever mainloop the backend runs. */
+enum {
+    LOOP_IN = 1,
+    LOOP_OUT = 2,
+};
+
+struct loop_io;
+struct loop_timer;
+
+typedef void (*loop_io_cb_t)(struct loop_io *io, int fd, void *raw);
+typedef void (*loop_timer_cb_t)(struct loop_timer *timer, void *raw);
+typedef void (*loop_signal_cb_t)(int sig, void *raw);
+
+struct loop_io *loop_io_new(struct pmixer_priv *priv, int fd, int events, loop_io_cb_t cb, void *raw);
+void loop_io_enable(struct loop_io *io, int events);
+void loop_io_free(struct loop_io *io);
+struct loop_timer *loop_timer_new(struct pmixer_priv *priv, loop_timer_cb_t cb, void *raw);
+void loop_timer_arm(struct loop_timer *timer, unsigned ms);
+void loop_timer_free(struct loop_timer *timer);
+int loop_signals_init(struct pmixer_priv *priv);
+int loop_signal(struct pmixer_priv *priv, int sig, loop_signal_cb_t cb, void *raw);
+void loop_signals_done(struct pmixer_priv *priv);
+int loop_iterate(struct pmixer_priv *priv);
+
+void metrics_command(enum target_type type, enum commands cmd);
+void metrics_invalid(void);
+void metrics_rejected(void);
+void metrics_flush(size_t count);
+void metrics_cache(int hit);
+void metrics_reconnect(void);
+void metrics_disconnect(void);
+void metrics_inflight(unsigned depth);
+void metrics_op(const char *name, uint64_t usec);
+void metrics_dump(FILE *f);
+
+/* targets is NULL with the PipeWire backend. */
+struct target;
+typedef void (*request_cb_t)(struct pmixer_priv *priv, int rc, const struct target *targets, size_t ntargets, void *raw);
+
+int submit_commands(struct pmixer_priv *priv, const struct selector *selector,
+                    const struct command *commands, size_t count,
+                    request_cb_t cb, void *raw);
+int wait_ops(struct pmixer_priv *priv);
+
+/* Keep every device's state current, so commands only cost the write. */
+int cache_start(struct pmixer_priv *priv);
+void cache_stop(struct pmixer_priv *priv);
+
+#ifndef PMIXER_PIPEWIRE
+
+struct target {
+    struct device_info before;
+    struct device_info after;
+};
+
+typedef void (*op_done_cb_t)(struct pmixer_priv *priv, enum op_status status, void *raw);
+
+int track_op(struct pmixer_priv *priv, pa_operation *op, const char *name, op_done_cb_t cb, void *raw);
+void cancel_ops(struct pmixer_priv *priv, void *raw);
+void free_op_pool(struct pmixer_priv *priv);
+void free_request_pool(struct pmixer_priv *priv);
+
+void copy_sink_info(struct device_info *i, const pa_sink_info *info);
+void copy_source_info(struct device_info *i, const pa_source_info *info);
+unsigned volume_percent(const pa_cvolume *volume);
+void apply_command(struct device_info *info, const struct command *command);
+
+typedef void (*cache_notify_cb_t)(struct sink_cache *cache, void *raw);
+
+struct sink_cache *cache_new(struct pmixer_priv *priv);
+void cache_set_notify(struct sink_cache *cache, cache_notify_cb_t cb, void *raw);
+void cache_free(struct sink_cache *cache);
+struct device_info *cache_default(struct sink_cache *cache, enum target_type type);
+void cache_update(struct sink_cache *cache, const struct device_info *info);
+void cache_hold(struct sink_cache *cache, const struct device_info *info);
+void cache_release(struct sink_cache *cache, enum target_type type, uint32_t index, int failed);
+
+float peak_float(const float *samples, size_t n);
+
+#endif
+
+int run_commands(struct pmixer_priv *priv, const struct selector *selector,
+                 const struct command *commands, size_t count);
+int run_command(struct pmixer_priv *priv, const struct selector *selector, const struct command *command);
+
+/* The batch lines for one target, in order: read once, written together. */
+struct batch_run {
+    struct selector selector;
+    char *pattern;
+    struct command *commands;
+    size_t count;
+    size_t alloc;
+};
+
+struct batch {
+    struct batch_run *runs;
+    size_t nruns;
+};
+
+int read_batch(const char *path, const struct selector *selector, struct batch *batch);
+void free_batch(struct batch *batch);
+int run_batch(struct pmixer_priv *priv, const struct batch *batch);
+
+enum output_format {
+    FORMAT_PLAIN,
+    FORMAT_JSON,
+    FORMAT_SHELL,
+};
+
+int run_get(struct pmixer_priv *priv, const struct selector *selector, enum output_format format);
+
+struct daemon_options {
+    const char *socket_path;
+    unsigned coalesce_ms;
+    unsigned idle_exit_ms;
+    unsigned bulk_inflight;
+};
+
+int run_daemon(struct pmixer_priv *priv, const struct daemon_options *options);
+
+int run_watch(struct pmixer_priv *priv);
+
+int run_keys(struct pmixer_priv *priv, const char *device);
+
+int run_save(struct pmixer_priv *priv, const char *path);
+int run_restore(struct pmixer_priv *priv, const char *path);
+
+struct fanout_options {
+    char **servers;
+    size_t nservers;
+    unsigned parallel;
+    unsigned connect_timeout_ms;
+    int no_autospawn;
+};
+
+int read_servers(const char *spec, struct fanout_options *options);
+void free_servers(struct fanout_options *options);
+int run_fanout(struct pmixer_priv *priv, const struct fanout_options *options, const struct batch *batch);
+
+enum timings_format {
+    TIMINGS_TEXT,
+    TIMINGS_JSON,
+};
+
+extern int timings_enabled;
+
+uint64_t now_usec(void);
+void timing_record(const char *name, uint64_t start, uint64_t end);
+void timings_print(enum timings_format format);
+
+void trace_record(const char *name, uint64_t start, uint64_t end, int status);
+void trace_dump(FILE *f);
+
+int run_meter(struct pmixer_priv *priv, unsigned rate);
+
+int run_fade(struct pmixer_priv *priv, const struct selector *selector,
+             unsigned percent, unsigned duration_ms, unsigned rate);
+
+#endif
@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "dbg.h"
+#include "proto.h"
+
+#define REPLY_MAX 256
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: pmixerc [-s PATH] [bulk] [source] <command> [ARG]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    const char *path = NULL;
+    const char *verb = NULL;
+    const char *arg = NULL;
+    int bulk = 0;
+    int source = 0;
+    struct command command;
+    char request[64];
+    char reply[REPLY_MAX];
+    size_t len = 0;
+    ssize_t n;
+    int fd = -1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            path = argv[++i];
+        else if (strcmp(argv[i], "bulk") == 0 && !verb && !source && !bulk)
+            bulk = 1;
+        else if (strcmp(argv[i], "source") == 0 && !verb && !source)
+            source = 1;
+        else if (argv[i][0] != '-' && !verb)
+            verb = argv[i];
+        else if (argv[i][0] != '-' && !arg)
+            arg = argv[i];
+        else
+            usage();
+    }
+    if (!verb)
+        usage();
+    check(parse_command(verb, arg, &command) == 0, "Invalid command: %s%s%s", verb, arg ? " " : "", arg ? arg : "");
+
+    if (!path)
+        path = default_socket_path();
+    check(strlen(path) < sizeof(addr.sun_path), "Socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    check(fd >= 0, "Can't create socket.");
+    check(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0, "Can't connect to daemon at %s", path);
+
+    len = snprintf(request, sizeof(request), "%s%s%s%s%s\n", bulk ? "bulk " : "", source ? "source " : "",
+                   verb, arg ? " " : "", arg ? arg : "");
+    check(len < sizeof(request), "Command too long.");
+    check(send(fd, request, len, MSG_NOSIGNAL) == (ssize_t)len, "Can't send command.");
+    shutdown(fd, SHUT_WR);
+
+    len = 0;
+    while (len < sizeof(reply) - 1 && (n = read(fd, reply + len, sizeof(reply) - 1 - len)) > 0)
+        len += n;
+    reply[len] = '\0';
+    close(fd);
+    fd = -1;
+
+    if (strncmp(reply, "error timeout", 13) == 0) {
+        log_err("Daemon replied: %s", reply);
+        return PMIXER_EXIT_TIMEOUT;
+    }
+    check(strncmp(reply, "ok", 2) == 0, "Daemon replied: %s", len ? reply : "nothing");
+    return 0;
+
+error:
+    if (fd >= 0)
+        close(fd);
+    return 1;
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "dbg.h"
+#include "proto.h"
+
+struct cmd_map cmd_map[] = {
+    {CMD_INC, "inc"},
+    {CMD_DEC, "dec"},
+    {CMD_MUTE, "mute"},
+    {CMD_SET, "set"},
+    { 0 }
+};
+
+enum commands lookup_command(const char *text)
+{
+    for(int i = 0; cmd_map[i].cmd != 0; i++) {
+        if (strcmp(text, cmd_map[i].text) == 0)
+            return cmd_map[i].cmd;
+    }
+    return CMD_NOP;
+}
+
+int parse_command(const char *verb, const char *arg, struct command *command)
+{
+    unsigned long percent;
+    char *end;
+
+    command->cmd = lookup_command(verb);
+    command->percent = 0;
+
+    switch (command->cmd) {
+        case CMD_SET:
+            if (!arg || *arg < '0' || *arg > '9')
+                return -1;
+            errno = 0;
+            percent = strtoul(arg, &end, 10);
+            if (*end == '%')
+                end++;
+            if (*end != '\0' || errno == ERANGE || percent > SET_PERCENT_MAX)
+                return -1;
+            command->percent = percent;
+            return 0;
+        case CMD_MUTE:
+            if (!arg)
+                return 0;
+            if (strcmp(arg, "on") == 0)
+                command->cmd = CMD_MUTE_ON;
+            else if (strcmp(arg, "off") == 0)
+                command->cmd = CMD_MUTE_OFF;
+            else
+                return -1;
+            return 0;
+        case CMD_NOP:
+            return -1;
+        default:
+            return arg ? -1 : 0;
+    }
+}
+
+int parse_command_line(char *line, struct command *command)
+{
+    char *save;
+    char *verb = strtok_r(line, " \t\r\n", &save);
+    char *arg = verb ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+
+    if (!verb || strtok_r(NULL, " \t\r\n", &save))
+        return -1;
+    return parse_command(verb, arg, command);
+}
+
+const char *default_socket_path(void)
+{
+    static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+
+    if (dir && *dir)
+        snprintf(path, sizeof(path), "%s/pmixer.sock", dir);
+    else
+        snprintf(path, sizeof(path), "/tmp/pmixer-%u.sock", (unsigned)getuid());
+    return path;
+}
+
+/* Asks the daemon for a text dump and copies it to stdout. */
+int fetch_dump(const char *socket_path, const char *request)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char buf[4096];
+    size_t len = strlen(request);
+    ssize_t n;
+    int fd = -1;
+
+    check(strlen(socket_path) < sizeof(addr.sun_path), "Socket path too long: %s", socket_path);
+    strcpy(addr.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    check(fd >= 0, "Can't create socket.");
+    check(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0, "Can't connect to daemon at %s", socket_path);
+    check(send(fd, request, len, MSG_NOSIGNAL) == (ssize_t)len && send(fd, "\n", 1, MSG_NOSIGNAL) == 1,
+          "Can't send %s request.", request);
+    shutdown(fd, SHUT_WR);
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        check(fwrite(buf, 1, n, stdout) == (size_t)n, "Can't write %s.", request);
+    check(n == 0, "Can't read %s.", request);
+    close(fd);
+    return 0;
+
+error:
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
@@ -0,0 +1,36 @@
+#ifndef __proto_h__
+#define __proto_h__
+
+enum commands {
+    CMD_NOP,
+    CMD_INC,
+    CMD_DEC,
+    CMD_MUTE,
+    CMD_MUTE_ON,
+    CMD_MUTE_OFF,
+    CMD_SET
+};
+
+#define SET_PERCENT_MAX 150
+
+#define PMIXER_EXIT_TIMEOUT 124
+
+struct command {
+    enum commands cmd;
+    unsigned percent;
+};
+
+struct cmd_map {
+    enum commands cmd;
+    char *text;
+};
+
+extern struct cmd_map cmd_map[];
+
+enum commands lookup_command(const char *text);
+int parse_command(const char *verb, const char *arg, struct command *command);
+int parse_command_line(char *line, struct command *command);
+const char *default_socket_path(void);
+int fetch_dump(const char *socket_path, const char *request);
+
+#endif
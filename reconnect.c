@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 10000
+
+struct reconnect {
+    struct pmixer_priv *priv;
+    session_cb_t up;
+    session_cb_t down;
+    void *raw;
+    unsigned backoff_ms;
+    struct loop_timer *retry;
+    struct loop_timer *deadline;
+    int armed;
+    int live;
+};
+
+static void retry_cb(struct loop_timer *timer, void *raw);
+
+static void free_deadline(struct reconnect *r)
+{
+    if (r->deadline) {
+        loop_timer_free(r->deadline);
+        r->deadline = NULL;
+    }
+}
+
+static void set_timer(struct reconnect *r, struct loop_timer **timer, unsigned ms, loop_timer_cb_t cb)
+{
+    if (!*timer)
+        *timer = loop_timer_new(r->priv, cb, r);
+    if (*timer)
+        loop_timer_arm(*timer, ms);
+}
+
+/* Full jitter over the upper half of the window, so clients that lost the
+ * same server do not all come back in the same instant. */
+static void schedule(struct reconnect *r)
+{
+    unsigned delay;
+
+    if (r->armed)
+        return;
+    delay = r->backoff_ms / 2 + random() % (r->backoff_ms / 2 + 1);
+    r->backoff_ms = r->backoff_ms * 2 > BACKOFF_MAX_MS ? BACKOFF_MAX_MS : r->backoff_ms * 2;
+
+    log_warn("Reconnecting in %ums.", delay);
+    set_timer(r, &r->retry, delay, retry_cb);
+    r->armed = r->retry != NULL;
+}
+
+static void lost(struct reconnect *r)
+{
+    free_deadline(r);
+    if (r->live) {
+        r->live = 0;
+        r->down(r->priv, r->raw);
+    }
+    schedule(r);
+}
+
+static void state_notify_cb(struct pmixer_priv *priv, void *raw)
+{
+    struct reconnect *r = raw;
+
+    if (priv->state == CONNECTED) {
+        free_deadline(r);
+        log_info("Reconnected.");
+        trace_record("reconnected", now_usec(), now_usec(), 0);
+        metrics_reconnect();
+        r->backoff_ms = BACKOFF_MIN_MS;
+        if (r->up(priv, r->raw) != 0) {
+            log_warn("Can't restore state after reconnecting.");
+            priv->state = ERROR;
+            lost(r);
+            return;
+        }
+        r->live = 1;
+    } else if (priv->state == ERROR) {
+        log_warn("%s: %s", r->live ? "Lost connection to server" : "Reconnect failed",
+                 server_error(priv));
+        trace_record(r->live ? "connection lost" : "reconnect", now_usec(), now_usec(), -1);
+        if (r->live)
+            metrics_disconnect();
+        lost(r);
+    }
+}
+
+static void deadline_cb(struct loop_timer *timer, void *raw)
+{
+    struct reconnect *r = raw;
+    struct pmixer_priv *priv = r->priv;
+
+    log_warn("Reconnect timed out after %ums.", priv->connect_timeout_ms);
+    stop_connect(priv);
+    priv->state = ERROR;
+    lost(r);
+}
+
+static void retry_cb(struct loop_timer *timer, void *raw)
+{
+    struct reconnect *r = raw;
+    struct pmixer_priv *priv = r->priv;
+
+    r->armed = 0;
+    priv->state_notify = state_notify_cb;
+    priv->state_notify_raw = r;
+
+    if (priv->connect_timeout_ms)
+        set_timer(r, &r->deadline, priv->connect_timeout_ms, deadline_cb);
+    if (start_connect(priv) == 0)
+        return;
+    priv->state = ERROR;
+    lost(r);
+}
+
+struct reconnect *reconnect_new(struct pmixer_priv *priv, session_cb_t up, session_cb_t down, void *raw)
+{
+    struct reconnect *r = calloc(1, sizeof(struct reconnect));
+
+    check_mem(r);
+    r->priv = priv;
+    r->up = up;
+    r->down = down;
+    r->raw = raw;
+    r->backoff_ms = BACKOFF_MIN_MS;
+    r->live = priv->state == CONNECTED;
+    srandom(now_usec() ^ getpid());
+
+    priv->state_notify = state_notify_cb;
+    priv->state_notify_raw = r;
+    return r;
+
+error:
+    return NULL;
+}
+
+void reconnect_free(struct reconnect *r)
+{
+    r->priv->state_notify = NULL;
+    r->priv->state_notify_raw = NULL;
+    free_deadline(r);
+    if (r->retry)
+        loop_timer_free(r->retry);
+    free(r);
+}
@@ -0,0 +1,62 @@
+#include <stdlib.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+static int add_servers(struct fanout_options *options, char *text)
+{
+    char *save;
+
+    text[strcspn(text, "#")] = '\0';
+    for (char *s = strtok_r(text, ", \t\r\n", &save); s; s = strtok_r(NULL, ", \t\r\n", &save)) {
+        char **grown = realloc(options->servers, (options->nservers + 1) * sizeof(char *));
+        check_mem(grown);
+        options->servers = grown;
+        check_mem(options->servers[options->nservers] = strdup(s));
+        options->nservers++;
+    }
+    return 0;
+
+error:
+    return -1;
+}
+
+int read_servers(const char *spec, struct fanout_options *options)
+{
+    FILE *file = NULL;
+    char *line = NULL;
+    size_t line_size = 0;
+
+    if (spec[0] != '@') {
+        check_mem(line = strdup(spec));
+        check(add_servers(options, line) == 0, "Can't add servers.");
+        free(line);
+        return 0;
+    }
+
+    file = strcmp(spec + 1, "-") == 0 ? stdin : fopen(spec + 1, "r");
+    check(file, "Can't open %s", spec + 1);
+    while (getline(&line, &line_size, file) >= 0)
+        check(add_servers(options, line) == 0, "Can't add servers.");
+    check(!ferror(file), "Error reading %s", spec + 1);
+
+    free(line);
+    if (file != stdin)
+        fclose(file);
+    return 0;
+
+error:
+    free(line);
+    if (file && file != stdin)
+        fclose(file);
+    return -1;
+}
+
+void free_servers(struct fanout_options *options)
+{
+    for (size_t i = 0; i < options->nservers; i++)
+        free(options->servers[i]);
+    free(options->servers);
+    options->servers = NULL;
+    options->nservers = 0;
+}
@@ -0,0 +1,525 @@
+#include <stdlib.h>
+#include <fnmatch.h>
+#include <math.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+struct request {
+    struct pmixer_priv *priv;
+    enum target_type type;
+    const char *pattern;
+    char pattern_buf[SINK_NAME_MAX];
+    struct target *targets;
+    size_t ntargets;
+    size_t alloc;
+    int failed;
+    int timed_out;
+    int pending;
+    int held;
+    int blind;
+    uint64_t started;
+    request_cb_t cb;
+    void *raw;
+    size_t count;
+    size_t commands_alloc;
+    struct command *commands;
+    struct request *next;
+};
+
+void copy_sink_info(struct device_info *i, const pa_sink_info *info)
+{
+    i->type = TARGET_SINK;
+    i->index = info->index;
+    i->mute = info->mute;
+    i->volume = info->volume;
+    snprintf(i->name, sizeof(i->name), "%s", info->name);
+}
+
+void copy_source_info(struct device_info *i, const pa_source_info *info)
+{
+    i->type = TARGET_SOURCE;
+    i->index = info->index;
+    i->mute = info->mute;
+    i->volume = info->volume;
+    snprintf(i->name, sizeof(i->name), "%s", info->name);
+}
+
+const char *target_name(enum target_type type)
+{
+    switch (type) {
+        case TARGET_SOURCE:
+            return "source";
+        case TARGET_SINK_INPUT:
+            return "stream";
+        default:
+            return "sink";
+    }
+}
+
+unsigned volume_percent(const pa_cvolume *volume)
+{
+    return (pa_cvolume_avg(volume) * 100 + PA_VOLUME_NORM / 2) / PA_VOLUME_NORM;
+}
+
+/* Requests are recycled along with their target and command arrays, so a
+ * connection stops allocating once it has seen its largest request. */
+static struct request *get_request(struct pmixer_priv *priv, size_t count)
+{
+    struct request *req = priv->spare_requests;
+    struct request saved = { 0 };
+
+    if (req) {
+        priv->spare_requests = req->next;
+        saved = *req;
+        memset(req, 0, sizeof(struct request));
+        req->targets = saved.targets;
+        req->alloc = saved.alloc;
+        req->commands = saved.commands;
+        req->commands_alloc = saved.commands_alloc;
+    } else {
+        req = calloc(1, sizeof(struct request));
+        check_mem(req);
+    }
+    req->priv = priv;
+
+    if (count > req->commands_alloc) {
+        struct command *grown = realloc(req->commands, count * sizeof(struct command));
+        check_mem(grown);
+        req->commands = grown;
+        req->commands_alloc = count;
+    }
+    return req;
+
+error:
+    if (req) {
+        req->next = priv->spare_requests;
+        priv->spare_requests = req;
+    }
+    return NULL;
+}
+
+static void free_request(struct request *req)
+{
+    struct pmixer_priv *priv = req->priv;
+
+    req->next = priv->spare_requests;
+    priv->spare_requests = req;
+}
+
+void free_request_pool(struct pmixer_priv *priv)
+{
+    while (priv->spare_requests) {
+        struct request *req = priv->spare_requests;
+        priv->spare_requests = req->next;
+        free(req->targets);
+        free(req->commands);
+        free(req);
+    }
+}
+
+static const char *request_names[] = { "sink request", "source request", "stream request" };
+
+static void finish_request(struct request *req)
+{
+    int rc = req->timed_out ? -ETIMEDOUT : req->failed ? -1 : 0;
+
+    trace_record(request_names[req->type], req->started, now_usec(), rc);
+
+    if (req->held && req->priv->cache) {
+        for (size_t i = 0; i < req->ntargets; i++)
+            cache_release(req->priv->cache, req->type, req->targets[i].after.index, rc != 0);
+    }
+    if (req->cb)
+        req->cb(req->priv, rc, req->targets, req->ntargets, req->raw);
+    free_request(req);
+}
+
+static int add_target(struct request *req, const struct device_info *info)
+{
+    if (req->ntargets == req->alloc) {
+        size_t alloc = req->alloc ? req->alloc * 2 : 4;
+        struct target *grown = realloc(req->targets, alloc * sizeof(struct target));
+        check_mem(grown);
+        req->targets = grown;
+        req->alloc = alloc;
+    }
+    req->targets[req->ntargets++].before = *info;
+    return 0;
+
+error:
+    req->failed = 1;
+    return -1;
+}
+
+static void note_status(struct request *req, enum op_status status)
+{
+    if (status == OP_TIMEOUT)
+        req->timed_out = 1;
+    if (status != OP_DONE)
+        req->failed = 1;
+}
+
+static void success_cb(pa_context *c, int success, void *raw)
+{
+    struct request *req = raw;
+
+    if (!success)
+        req->failed = 1;
+}
+
+static void write_done_cb(struct pmixer_priv *priv, enum op_status status, void *raw)
+{
+    struct request *req = raw;
+
+    note_status(req, status);
+    if (--req->pending == 0)
+        finish_request(req);
+}
+
+static void set_volume(struct request *req, const struct device_info *info)
+{
+    pa_context *c = req->priv->context;
+    pa_operation *op;
+
+    if (req->type == TARGET_SINK_INPUT)
+        op = pa_context_set_sink_input_volume(c, info->index, &info->volume, success_cb, req);
+    else if (req->type == TARGET_SOURCE && info->index == PA_INVALID_INDEX)
+        op = pa_context_set_source_volume_by_name(c, info->name, &info->volume, success_cb, req);
+    else if (req->type == TARGET_SOURCE)
+        op = pa_context_set_source_volume_by_index(c, info->index, &info->volume, success_cb, req);
+    else if (info->index == PA_INVALID_INDEX)
+        op = pa_context_set_sink_volume_by_name(c, info->name, &info->volume, success_cb, req);
+    else
+        op = pa_context_set_sink_volume_by_index(c, info->index, &info->volume, success_cb, req);
+    req->pending++;
+    if (track_op(req->priv, op, "set_volume", write_done_cb, req) != 0) {
+        req->pending--;
+        req->failed = 1;
+    }
+}
+
+static void set_mute(struct request *req, const struct device_info *info)
+{
+    pa_context *c = req->priv->context;
+    pa_operation *op;
+
+    if (req->type == TARGET_SINK_INPUT)
+        op = pa_context_set_sink_input_mute(c, info->index, info->mute, success_cb, req);
+    else if (req->type == TARGET_SOURCE && info->index == PA_INVALID_INDEX)
+        op = pa_context_set_source_mute_by_name(c, info->name, info->mute, success_cb, req);
+    else if (req->type == TARGET_SOURCE)
+        op = pa_context_set_source_mute_by_index(c, info->index, info->mute, success_cb, req);
+    else if (info->index == PA_INVALID_INDEX)
+        op = pa_context_set_sink_mute_by_name(c, info->name, info->mute, success_cb, req);
+    else
+        op = pa_context_set_sink_mute_by_index(c, info->index, info->mute, success_cb, req);
+    req->pending++;
+    if (track_op(req->priv, op, "set_mute", write_done_cb, req) != 0) {
+        req->pending--;
+        req->failed = 1;
+    }
+}
+
+void apply_command(struct device_info *info, const struct command *command)
+{
+    switch (command->cmd) {
+        case CMD_MUTE:
+            info->mute = !info->mute;
+            break;
+        case CMD_MUTE_ON:
+            info->mute = 1;
+            break;
+        case CMD_MUTE_OFF:
+            info->mute = 0;
+            break;
+        case CMD_SET:
+            pa_cvolume_scale(&info->volume, (pa_volume_t)command->percent * PA_VOLUME_NORM / 100);
+            break;
+        case CMD_INC:
+        case CMD_DEC:
+            /* Scaling moves the loudest channel onto the rung and keeps the balance. */
+            pa_cvolume_scale(&info->volume,
+                             lround(step_volume((double)pa_cvolume_max(&info->volume) / PA_VOLUME_NORM,
+                                                command->cmd == CMD_INC) * PA_VOLUME_NORM));
+            break;
+        case CMD_NOP:
+            break;
+    }
+}
+
+static int touches_volume(const struct request *req)
+{
+    for (size_t i = 0; i < req->count; i++) {
+        enum commands cmd = req->commands[i].cmd;
+        if (cmd == CMD_INC || cmd == CMD_DEC || cmd == CMD_SET)
+            return 1;
+    }
+    return 0;
+}
+
+static int touches_mute(const struct request *req)
+{
+    for (size_t i = 0; i < req->count; i++) {
+        enum commands cmd = req->commands[i].cmd;
+        if (cmd == CMD_MUTE || cmd == CMD_MUTE_ON || cmd == CMD_MUTE_OFF)
+            return 1;
+    }
+    return 0;
+}
+
+/* True unless every change is absolute, i.e. set or mute on/off comes first. */
+static int needs_read(const struct request *req)
+{
+    int volume_known = 0;
+    int mute_known = 0;
+
+    for (size_t i = 0; i < req->count; i++) {
+        switch (req->commands[i].cmd) {
+            case CMD_SET:
+                volume_known = 1;
+                break;
+            case CMD_INC:
+            case CMD_DEC:
+                if (!volume_known)
+                    return 1;
+                break;
+            case CMD_MUTE_ON:
+            case CMD_MUTE_OFF:
+                mute_known = 1;
+                break;
+            case CMD_MUTE:
+                if (!mute_known)
+                    return 1;
+                break;
+            case CMD_NOP:
+                break;
+        }
+    }
+    return !volume_known && !mute_known;
+}
+
+static void commit_sinks(struct request *req)
+{
+    req->pending++;
+    for (size_t t = 0; t < req->ntargets; t++) {
+        struct device_info *old = &req->targets[t].before;
+        struct device_info *new = &req->targets[t].after;
+
+        *new = *old;
+        for (size_t i = 0; i < req->count; i++)
+            apply_command(new, &req->commands[i]);
+
+#ifndef NDEBUG
+        /* Per channel: an average hides what a step does to the balance. */
+        if (!req->blind && log_level >= LOG_DEBUG) {
+            char before[PA_CVOLUME_SNPRINT_MAX];
+            char after[PA_CVOLUME_SNPRINT_MAX];
+
+            debug("got %s %d (%s), volume %s -> %s", target_name(req->type), old->index, old->name,
+                  pa_cvolume_snprint(before, sizeof(before), &old->volume),
+                  pa_cvolume_snprint(after, sizeof(after), &new->volume));
+        }
+#endif
+
+        /* Blind writes go by name and have no index to hold. */
+        if (req->priv->cache && req->type != TARGET_SINK_INPUT && !req->blind) {
+            cache_hold(req->priv->cache, new);
+            req->held = 1;
+        }
+
+        if (req->blind ? touches_volume(req) : !pa_cvolume_equal(&old->volume, &new->volume))
+            set_volume(req, new);
+        if (req->blind ? touches_mute(req) : old->mute != new->mute)
+            set_mute(req, new);
+    }
+    if (--req->pending == 0)
+        finish_request(req);
+}
+
+static void sink_info_cb(pa_context *c, const pa_sink_info *info, int eol, void *raw)
+{
+    struct request *req = raw;
+    struct device_info sink;
+
+    if (eol != 0) return;
+    if (req->pattern && fnmatch(req->pattern, info->name, 0) != 0)
+        return;
+
+    copy_sink_info(&sink, info);
+    add_target(req, &sink);
+}
+
+static void source_info_cb(pa_context *c, const pa_source_info *info, int eol, void *raw)
+{
+    struct request *req = raw;
+    struct device_info source;
+
+    if (eol != 0) return;
+    if (req->pattern && fnmatch(req->pattern, info->name, 0) != 0)
+        return;
+
+    copy_source_info(&source, info);
+    add_target(req, &source);
+}
+
+static void sink_input_info_cb(pa_context *c, const pa_sink_input_info *info, int eol, void *raw)
+{
+    struct request *req = raw;
+    struct device_info stream = { 0 };
+    const char *name;
+    const char *binary;
+
+    if (eol != 0) return;
+    if (!info->has_volume || !info->volume_writable)
+        return;
+
+    name = pa_proplist_gets(info->proplist, PA_PROP_APPLICATION_NAME);
+    binary = pa_proplist_gets(info->proplist, PA_PROP_APPLICATION_PROCESS_BINARY);
+    if (!(name && fnmatch(req->pattern, name, 0) == 0) &&
+        !(binary && fnmatch(req->pattern, binary, 0) == 0))
+        return;
+
+    stream.type = TARGET_SINK_INPUT;
+    stream.index = info->index;
+    stream.mute = info->mute;
+    stream.volume = info->volume;
+    snprintf(stream.name, sizeof(stream.name), "%s", name ? name : binary ? binary : info->name);
+    add_target(req, &stream);
+}
+
+static void lookup_done_cb(struct pmixer_priv *priv, enum op_status status, void *raw)
+{
+    struct request *req = raw;
+
+    note_status(req, status);
+    if (!req->failed && req->ntargets == 0) {
+        if (req->pattern)
+            log_err("No %s matches %s", target_name(req->type), req->pattern);
+        else
+            log_err("Unable to get info for default %s.", target_name(req->type));
+        req->failed = 1;
+    }
+    if (req->failed) {
+        finish_request(req);
+        return;
+    }
+    commit_sinks(req);
+}
+
+static int get_sinks(struct request *req)
+{
+    pa_operation *op;
+
+    if (req->type == TARGET_SINK_INPUT)
+        op = pa_context_get_sink_input_info_list(req->priv->context, sink_input_info_cb, req);
+    else if (req->type == TARGET_SOURCE)
+        op = pa_context_get_source_info_list(req->priv->context, source_info_cb, req);
+    else
+        op = pa_context_get_sink_info_list(req->priv->context, sink_info_cb, req);
+    check(track_op(req->priv, op, "get_info_list", lookup_done_cb, req) == 0, "Unable to list %ss.",
+          target_name(req->type));
+    return 0;
+
+error:
+    return -1;
+}
+
+static int get_default_sink(struct request *req)
+{
+    const char *name = req->type == TARGET_SOURCE ? "@DEFAULT_SOURCE@" : "@DEFAULT_SINK@";
+    struct device_info *cached;
+    struct device_info blind = { .type = req->type, .index = PA_INVALID_INDEX };
+    pa_operation *op;
+
+    if (req->priv->cache)
+        metrics_cache((cached = cache_default(req->priv->cache, req->type)) != NULL);
+    else
+        cached = NULL;
+    if (cached) {
+        check(add_target(req, cached) == 0, "Can't queue default %s.", target_name(req->type));
+        commit_sinks(req);
+        return 0;
+    }
+
+    /* The server scales a mono volume onto every channel, keeping balance. */
+    if (!needs_read(req)) {
+        snprintf(blind.name, sizeof(blind.name), "%s", name);
+        pa_cvolume_set(&blind.volume, 1, PA_VOLUME_MUTED);
+        check(add_target(req, &blind) == 0, "Can't queue default %s.", target_name(req->type));
+        req->blind = 1;
+        commit_sinks(req);
+        return 0;
+    }
+
+    if (req->type == TARGET_SOURCE) {
+        op = pa_context_get_source_info_by_name(req->priv->context, name, source_info_cb, req);
+        check(track_op(req->priv, op, "get_source_info", lookup_done_cb, req) == 0,
+              "Unable to get info for default source.");
+    } else {
+        op = pa_context_get_sink_info_by_name(req->priv->context, name, sink_info_cb, req);
+        check(track_op(req->priv, op, "get_sink_info", lookup_done_cb, req) == 0,
+              "Unable to get info for default sink.");
+    }
+    return 0;
+
+error:
+    return -1;
+}
+
+int submit_commands(struct pmixer_priv *priv, const struct selector *selector,
+                    const struct command *commands, size_t count,
+                    request_cb_t cb, void *raw)
+{
+    struct request *req = get_request(priv, count);
+
+    check(req, "Can't allocate request.");
+    req->started = now_usec();
+    req->cb = cb;
+    req->raw = raw;
+    req->count = count;
+    if (count)
+        memcpy(req->commands, commands, count * sizeof(struct command));
+    req->type = selector->type;
+    for (size_t i = 0; i < count; i++)
+        metrics_command(req->type, commands[i].cmd);
+
+    if (selector->pattern) {
+        check(strlen(selector->pattern) < sizeof(req->pattern_buf), "Pattern too long: %s", selector->pattern);
+        strcpy(req->pattern_buf, selector->pattern);
+        req->pattern = req->pattern_buf;
+        check(get_sinks(req) == 0, "Can't find targets matching %s", selector->pattern);
+    } else {
+        check(req->type != TARGET_SINK_INPUT, "Streams need a pattern.");
+        check(get_default_sink(req) == 0, "Can't get default %s.", target_name(req->type));
+    }
+    return 0;
+
+error:
+    if (req)
+        free_request(req);
+    return -1;
+}
+
+static void run_done_cb(struct pmixer_priv *priv, int rc, const struct target *targets, size_t ntargets, void *raw)
+{
+    *(int *)raw = rc;
+}
+
+int run_commands(struct pmixer_priv *priv, const struct selector *selector,
+                 const struct command *commands, size_t count)
+{
+    int rc = -1;
+
+    check(submit_commands(priv, selector, commands, count, run_done_cb, &rc) == 0, "Can't run commands.");
+    check(wait_ops(priv) == 0, "Lost connection to server.");
+    return rc;
+
+error:
+    return -1;
+}
+
+int run_command(struct pmixer_priv *priv, const struct selector *selector, const struct command *command)
+{
+    return run_commands(priv, selector, command, 1);
+}
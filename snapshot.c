@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+#define SNAPSHOT_HEADER "pmixer-state 1"
+
+enum snapshot_kind {
+    SNAPSHOT_SINK,
+    SNAPSHOT_SOURCE,
+};
+
+static const char *kind_names[] = { "sink", "source" };
+
+struct snapshot_entry {
+    struct snapshot *snapshot;
+    enum snapshot_kind kind;
+    struct device_info info;
+    int failed;
+};
+
+struct snapshot {
+    struct snapshot_entry *entries;
+    size_t n;
+    size_t alloc;
+    int failed;
+};
+
+static struct snapshot_entry *add_entry(struct snapshot *s, enum snapshot_kind kind)
+{
+    if (s->n == s->alloc) {
+        size_t alloc = s->alloc ? s->alloc * 2 : 16;
+        struct snapshot_entry *grown = realloc(s->entries, alloc * sizeof(struct snapshot_entry));
+        check_mem(grown);
+        s->entries = grown;
+        s->alloc = alloc;
+    }
+    memset(&s->entries[s->n], 0, sizeof(struct snapshot_entry));
+    s->entries[s->n].kind = kind;
+    return &s->entries[s->n++];
+
+error:
+    s->failed = 1;
+    return NULL;
+}
+
+static void save_sink_cb(pa_context *c, const pa_sink_info *info, int eol, void *raw)
+{
+    struct snapshot *s = raw;
+    struct snapshot_entry *e;
+
+    if (eol != 0) return;
+    if ((e = add_entry(s, SNAPSHOT_SINK)))
+        copy_sink_info(&e->info, info);
+}
+
+static void save_source_cb(pa_context *c, const pa_source_info *info, int eol, void *raw)
+{
+    struct snapshot *s = raw;
+    struct snapshot_entry *e;
+
+    if (eol != 0) return;
+    /* Monitors follow their sink; restoring them separately would fight it. */
+    if (info->monitor_of_sink != PA_INVALID_INDEX)
+        return;
+    if ((e = add_entry(s, SNAPSHOT_SOURCE)))
+        copy_source_info(&e->info, info);
+}
+
+static void list_done_cb(struct pmixer_priv *priv, enum op_status status, void *raw)
+{
+    struct snapshot *s = raw;
+
+    if (status != OP_DONE)
+        s->failed = 1;
+}
+
+static int write_snapshot(const struct snapshot *s, const char *path)
+{
+    FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+
+    check(f, "Can't open %s", path);
+    fprintf(f, SNAPSHOT_HEADER "\n");
+    for (size_t i = 0; i < s->n; i++) {
+        const struct snapshot_entry *e = &s->entries[i];
+
+        fprintf(f, "%s %d %u", kind_names[e->kind], e->info.mute ? 1 : 0, e->info.volume.channels);
+        for (unsigned c = 0; c < e->info.volume.channels; c++)
+            fprintf(f, " %u", e->info.volume.values[c]);
+        fprintf(f, " %s\n", e->info.name);
+    }
+    if (f == stdout) {
+        check(fflush(f) == 0 && !ferror(f), "Can't write %s", path);
+    } else {
+        int failed = ferror(f);
+
+        failed |= fclose(f) != 0;
+        f = NULL;
+        check(!failed, "Can't write %s", path);
+    }
+    return 0;
+
+error:
+    if (f && f != stdout)
+        fclose(f);
+    return -1;
+}
+
+int run_save(struct pmixer_priv *priv, const char *path)
+{
+    struct snapshot s = { 0 };
+    pa_operation *op;
+
+    op = pa_context_get_sink_info_list(priv->context, save_sink_cb, &s);
+    check(track_op(priv, op, "get_sink_info_list", list_done_cb, &s) == 0, "Unable to list sinks.");
+    op = pa_context_get_source_info_list(priv->context, save_source_cb, &s);
+    check(track_op(priv, op, "get_source_info_list", list_done_cb, &s) == 0, "Unable to list sources.");
+    check(wait_ops(priv) == 0 && !s.failed, "Unable to read mixer state.");
+
+    check(write_snapshot(&s, path) == 0, "Can't save mixer state.");
+    log_info("Saved %zu objects to %s", s.n, path);
+    free(s.entries);
+    return 0;
+
+error:
+    free(s.entries);
+    return -1;
+}
+
+/* kind mute channels volume... name, the name running to the end of the line. */
+static int parse_entry(char *line, struct snapshot_entry *e)
+{
+    char *p = line;
+    char *end;
+    size_t len = strcspn(p, " ");
+    unsigned long v;
+
+    if (len == 4 && strncmp(p, "sink", 4) == 0)
+        e->kind = SNAPSHOT_SINK;
+    else if (len == 6 && strncmp(p, "source", 6) == 0)
+        e->kind = SNAPSHOT_SOURCE;
+    else
+        return -1;
+    p += len;
+
+    v = strtoul(p, &end, 10);
+    if (end == p || v > 1)
+        return -1;
+    e->info.mute = v;
+    p = end;
+
+    v = strtoul(p, &end, 10);
+    if (end == p || v == 0 || v > PA_CHANNELS_MAX)
+        return -1;
+    e->info.volume.channels = v;
+    p = end;
+
+    for (unsigned c = 0; c < e->info.volume.channels; c++) {
+        v = strtoul(p, &end, 10);
+        if (end == p || v > PA_VOLUME_MAX)
+            return -1;
+        e->info.volume.values[c] = v;
+        p = end;
+    }
+
+    if (*p != ' ' || p[1] == '\0')
+        return -1;
+    p++;
+    p[strcspn(p, "\r\n")] = '\0';
+    if (*p == '\0' || strlen(p) >= sizeof(e->info.name))
+        return -1;
+    strcpy(e->info.name, p);
+    e->info.index = PA_INVALID_INDEX;
+    return 0;
+}
+
+static int read_snapshot(struct snapshot *s, const char *path)
+{
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0;
+
+    check(f, "Can't open %s", path);
+    while (getline(&line, &size, f) != -1) {
+        struct snapshot_entry *e;
+
+        lineno++;
+        if (lineno == 1) {
+            check(strncmp(line, SNAPSHOT_HEADER, strlen(SNAPSHOT_HEADER)) == 0, "%s is not a pmixer state file.", path);
+            continue;
+        }
+        e = add_entry(s, SNAPSHOT_SINK);
+        check(e, "Out of memory.");
+        check(parse_entry(line, e) == 0, "%s:%d: invalid entry", path, lineno);
+    }
+    check(!ferror(f), "Can't read %s", path);
+    check(lineno > 0, "%s is empty.", path);
+
+    free(line);
+    if (f != stdin)
+        fclose(f);
+    return 0;
+
+error:
+    free(line);
+    if (f && f != stdin)
+        fclose(f);
+    return -1;
+}
+
+static void restore_cb(pa_context *c, int success, void *raw)
+{
+    struct snapshot_entry *e = raw;
+
+    if (!success && !e->failed) {
+        log_err("Can't restore %s %s: %s", kind_names[e->kind], e->info.name, pa_strerror(pa_context_errno(c)));
+        e->failed = 1;
+        e->snapshot->failed = 1;
+    }
+}
+
+static void restore_done_cb(struct pmixer_priv *priv, enum op_status status, void *raw)
+{
+    struct snapshot_entry *e = raw;
+
+    if (status != OP_DONE)
+        e->snapshot->failed = 1;
+}
+
+/* Every write goes out before waiting for any reply, so restoring costs
+ * about one round trip however many objects there are. */
+int run_restore(struct pmixer_priv *priv, const char *path)
+{
+    struct snapshot s = { 0 };
+    pa_operation *op;
+
+    check(read_snapshot(&s, path) == 0, "Can't read mixer state.");
+
+    for (size_t i = 0; i < s.n; i++) {
+        struct snapshot_entry *e = &s.entries[i];
+        const char *name = e->info.name;
+
+        e->snapshot = &s;
+        if (e->kind == SNAPSHOT_SINK) {
+            op = pa_context_set_sink_volume_by_name(priv->context, name, &e->info.volume, restore_cb, e);
+            check(track_op(priv, op, "set_volume", restore_done_cb, e) == 0, "Can't restore %s", name);
+            op = pa_context_set_sink_mute_by_name(priv->context, name, e->info.mute, restore_cb, e);
+            check(track_op(priv, op, "set_mute", restore_done_cb, e) == 0, "Can't restore %s", name);
+        } else {
+            op = pa_context_set_source_volume_by_name(priv->context, name, &e->info.volume, restore_cb, e);
+            check(track_op(priv, op, "set_source_volume", restore_done_cb, e) == 0, "Can't restore %s", name);
+            op = pa_context_set_source_mute_by_name(priv->context, name, e->info.mute, restore_cb, e);
+            check(track_op(priv, op, "set_source_mute", restore_done_cb, e) == 0, "Can't restore %s", name);
+        }
+    }
+    check(wait_ops(priv) == 0, "Lost connection to server.");
+    check(!s.failed, "Some objects were not restored.");
+
+    log_info("Restored %zu objects from %s", s.n, path);
+    free(s.entries);
+    return 0;
+
+error:
+    if (priv->state == CONNECTED)
+        wait_ops(priv);
+    free(s.entries);
+    return -1;
+}
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+#define STEPS_MAX 512
+#define DB_FLOOR -60.0
+#define EPSILON 1e-4
+
+/* Cubic steps are additive, as they always were. The other modes keep
+ * every rung a step can land on, ascending, on the cubic scale where 1.0
+ * is 100% (PulseAudio's pa_volume_t / PA_VOLUME_NORM). The ladder is built
+ * while parsing options, before any connection exists, and only read after
+ * that, so the library's threads can share it. */
+static enum step_mode step_mode = STEP_CUBIC;
+static double step_size = 5;
+static double ladder[STEPS_MAX];
+static size_t rungs;
+
+static int add_rung(double volume)
+{
+    check(rungs < STEPS_MAX, "Step too small, more than %d steps.", STEPS_MAX);
+    ladder[rungs++] = volume;
+    return 0;
+
+error:
+    return -1;
+}
+
+/* Linear amplitude is the cube and dB is 60 log10 on this scale, the same
+ * conversion pa_sw_volume_from_linear() and pa_sw_volume_from_dB() use. */
+static int build_ladder(enum step_mode mode, double size)
+{
+    double max_linear = VOLUME_UI_MAX * VOLUME_UI_MAX * VOLUME_UI_MAX;
+    double max_db = 60.0 * log10(VOLUME_UI_MAX);
+
+    rungs = 0;
+    switch (mode) {
+        case STEP_CUBIC:
+            return 0;
+        case STEP_LINEAR:
+            for (int k = 0; k * size / 100.0 < max_linear - EPSILON; k++)
+                check(add_rung(cbrt(k * size / 100.0)) == 0, "Can't build step table.");
+            break;
+        case STEP_DB:
+            check(add_rung(0) == 0, "Can't build step table.");
+            for (int k = (int)ceil(DB_FLOOR / size); k * size < max_db - EPSILON; k++)
+                check(add_rung(pow(10.0, k * size / 60.0)) == 0, "Can't build step table.");
+            break;
+    }
+    return add_rung(VOLUME_UI_MAX);
+
+error:
+    return -1;
+}
+
+int parse_step(const char *spec)
+{
+    static const struct {
+        const char *name;
+        enum step_mode mode;
+        double size;
+    } modes[] = {
+        { "cubic", STEP_CUBIC, 5 },
+        { "linear", STEP_LINEAR, 5 },
+        { "db", STEP_DB, 2 },
+    };
+    size_t len = strcspn(spec, ":");
+    char *end;
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        double size = modes[i].size;
+
+        if (strlen(modes[i].name) != len || strncmp(spec, modes[i].name, len) != 0)
+            continue;
+        if (spec[len] == ':') {
+            size = strtod(spec + len + 1, &end);
+            if (end == spec + len + 1 || *end != '\0' || !(size > 0))
+                return -1;
+        }
+        if (build_ladder(modes[i].mode, size) != 0)
+            return -1;
+        step_mode = modes[i].mode;
+        step_size = size;
+        return 0;
+    }
+    return -1;
+}
+
+/* The next rung above or below. Volumes that are off the ladder snap onto
+ * it in the direction of the step, skipping a rung less than half a step
+ * away so that every step is audible. Cubic steps just add SIZE percent. */
+double step_volume(double current, int up)
+{
+    size_t lo = 0;
+    size_t hi;
+
+    if (step_mode == STEP_CUBIC) {
+        double target = current + (up ? step_size : -step_size) / 100.0;
+
+        if (target > VOLUME_UI_MAX)
+            return up ? VOLUME_UI_MAX : target;
+        return target > 0 ? target : 0;
+    }
+
+    hi = rungs;
+    if (up) {
+        /* First rung above current. */
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (ladder[mid] > current + EPSILON)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        if (lo + 1 < rungs && ladder[lo] - current < (ladder[lo + 1] - ladder[lo]) / 2)
+            lo++;
+        return lo < rungs ? ladder[lo] : current;
+    }
+
+    /* Last rung below current. */
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (ladder[mid] < current - EPSILON)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 1 && current - ladder[lo - 1] < (ladder[lo - 1] - ladder[lo - 2]) / 2)
+        lo--;
+    return lo > 0 ? ladder[lo - 1] : 0;
+}
@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+#define TIMINGS_MAX 64
+
+struct timing {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+};
+
+int timings_enabled;
+
+static struct timing timings[TIMINGS_MAX];
+static _Atomic size_t ntimings;
+static _Atomic size_t dropped;
+
+uint64_t now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Slots are claimed atomically, so concurrent recorders never share one. */
+void timing_record(const char *name, uint64_t start, uint64_t end)
+{
+    size_t slot = ntimings;
+
+    do {
+        if (slot == TIMINGS_MAX) {
+            dropped++;
+            return;
+        }
+    } while (!atomic_compare_exchange_weak(&ntimings, &slot, slot + 1));
+    timings[slot] = (struct timing){ name, start, end };
+}
+
+static void sort_timings(void)
+{
+    for (size_t i = 1; i < ntimings; i++) {
+        struct timing t = timings[i];
+        size_t j = i;
+
+        for (; j > 0 && timings[j - 1].start > t.start; j--)
+            timings[j] = timings[j - 1];
+        timings[j] = t;
+    }
+}
+
+void timings_print(enum timings_format format)
+{
+    uint64_t origin;
+    uint64_t last;
+
+    sort_timings();
+    origin = last = ntimings ? timings[0].start : 0;
+
+    for (size_t i = 0; i < ntimings; i++) {
+        if (timings[i].end > last)
+            last = timings[i].end;
+    }
+
+    if (format == TIMINGS_JSON) {
+        fprintf(stderr, "{\"phases\":[");
+        for (size_t i = 0; i < ntimings; i++) {
+            fprintf(stderr, "%s{\"name\":\"%s\",\"start_us\":%llu,\"duration_us\":%llu}",
+                    i ? "," : "", timings[i].name,
+                    (unsigned long long)(timings[i].start - origin),
+                    (unsigned long long)(timings[i].end - timings[i].start));
+        }
+        fprintf(stderr, "],\"total_us\":%llu,\"dropped\":%zu}\n",
+                (unsigned long long)(last - origin), dropped);
+        return;
+    }
+
+    fprintf(stderr, "%-20s %10s %10s\n", "phase", "start ms", "ms");
+    for (size_t i = 0; i < ntimings; i++) {
+        fprintf(stderr, "%-20s %10.3f %10.3f\n", timings[i].name,
+                (timings[i].start - origin) / 1000.0,
+                (timings[i].end - timings[i].start) / 1000.0);
+    }
+    fprintf(stderr, "%-20s %10s %10.3f\n", "total", "", (last - origin) / 1000.0);
+    if (dropped)
+        fprintf(stderr, "(%zu phases not recorded)\n", dropped);
+}
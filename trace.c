@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+#define TRACE_SIZE 512
+
+struct trace_entry {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    int status;
+};
+
+int log_level = LOG_WARN;
+
+/* Recording is a struct copy into a fixed ring; nothing is formatted until
+ * somebody asks for a dump. Slots are claimed atomically, so library
+ * instances on their own mainloop threads can record at once. */
+static struct trace_entry ring[TRACE_SIZE];
+static _Atomic uint64_t recorded;
+
+void trace_record(const char *name, uint64_t start, uint64_t end, int status)
+{
+    ring[recorded++ % TRACE_SIZE] = (struct trace_entry){ name, start, end, status };
+}
+
+static const char *status_text(int status)
+{
+    switch (status) {
+        case 0:
+            return "ok";
+        case -ETIMEDOUT:
+            return "timeout";
+        case -ECANCELED:
+            return "cancelled";
+        default:
+            return "failed";
+    }
+}
+
+void trace_dump(FILE *f)
+{
+    uint64_t now = now_usec();
+    uint64_t total = recorded;
+    uint64_t first = total > TRACE_SIZE ? total - TRACE_SIZE : 0;
+
+    fprintf(f, "%12s %10s  %-9s %s\n", "ago ms", "took ms", "status", "what");
+    for (uint64_t i = first; i < total; i++) {
+        const struct trace_entry *e = &ring[i % TRACE_SIZE];
+
+        fprintf(f, "%12.3f %10.3f  %-9s %s\n", (now - e->end) / 1000.0, (e->end - e->start) / 1000.0,
+                status_text(e->status), e->name);
+    }
+    if (first)
+        fprintf(f, "(%llu older entries overwritten)\n", (unsigned long long)first);
+    fflush(f);
+}
+
+#ifndef PMIXER_PIPEWIRE
+void trace_signal_cb(pa_mainloop_api *api, pa_signal_event *e, int sig, void *raw)
+{
+    trace_dump(stderr);
+}
+#endif
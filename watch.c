@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <signal.h>
+
+#include "dbg.h"
+#include "pmixer.h"
+
+struct watch {
+    int shown;
+    uint32_t index;
+    unsigned percent;
+    int mute;
+    int quit;
+};
+
+static void show_cb(struct sink_cache *cache, void *raw)
+{
+    struct watch *w = raw;
+    struct device_info *info = cache_default(cache, TARGET_SINK);
+    unsigned percent;
+
+    if (!info)
+        return;
+
+    percent = volume_percent(&info->volume);
+    if (w->shown && w->index == info->index && w->percent == percent && w->mute == info->mute)
+        return;
+
+    w->shown = 1;
+    w->index = info->index;
+    w->percent = percent;
+    w->mute = info->mute;
+    printf("%u%%%s\n", percent, info->mute ? " muted" : "");
+}
+
+static int session_up(struct pmixer_priv *priv, void *raw)
+{
+    priv->cache = cache_new(priv);
+    if (!priv->cache)
+        return -1;
+    cache_set_notify(priv->cache, show_cb, raw);
+    return 0;
+}
+
+static int session_down(struct pmixer_priv *priv, void *raw)
+{
+    if (priv->cache) {
+        cache_free(priv->cache);
+        priv->cache = NULL;
+    }
+    return 0;
+}
+
+static void quit_cb(pa_mainloop_api *api, pa_signal_event *e, int sig, void *raw)
+{
+    struct watch *w = raw;
+    w->quit = 1;
+}
+
+int run_watch(struct pmixer_priv *priv)
+{
+    struct watch w = { 0 };
+    struct reconnect *reconnect = NULL;
+    int retval;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    check(pa_signal_init(priv->mainloop_api) == 0, "Can't set up signal handling.");
+    pa_signal_new(SIGINT, quit_cb, &w);
+    pa_signal_new(SIGTERM, quit_cb, &w);
+    pa_signal_new(SIGUSR1, trace_signal_cb, NULL);
+
+    priv->cache = cache_new(priv);
+    check(priv->cache, "Can't subscribe to sink events.");
+    check(wait_ops(priv) == 0, "Unable to populate sink cache.");
+    cache_set_notify(priv->cache, show_cb, &w);
+    show_cb(priv->cache, &w);
+    reconnect = reconnect_new(priv, session_up, session_down, &w);
+    check(reconnect, "Can't set up reconnect.");
+
+    while (!w.quit) {
+        if (pa_mainloop_iterate(priv->mainloop, 1, &retval) < 0)
+            break;
+    }
+
+    retval = 0;
+    goto out;
+
+error:
+    retval = -1;
+out:
+    if (reconnect)
+        reconnect_free(reconnect);
+    if (priv->cache) {
+        if (priv->state == CONNECTED)
+            wait_ops(priv);
+        cache_free(priv->cache);
+        priv->cache = NULL;
+    }
+    pa_signal_done();
+    return retval;
+}